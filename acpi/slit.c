@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <acpi/slit.h>
+#include <kern/printf.h>
+#include <mm/numa.h>
+
+const struct acpi_slit *slit = NULL;
+
+void init_slit(void)
+{
+    uint64_t i, j;
+    uint64_t count;
+    const uint8_t *matrix;
+
+    if((slit = acpi_lookup("SLIT")) == NULL) {
+        kprintf(KP_INFORM, "acpi: SLIT table is not present");
+        return;
+    }
+
+    if(acpi_sdt_checksum(slit)) {
+        kprintf(KP_WARNING, "acpi: SLIT failed checksum validation");
+        slit = NULL;
+        return;
+    }
+
+    count = slit->locality_count;
+    matrix = (const uint8_t *)(&slit[1]);
+
+    if((sizeof(struct acpi_slit) + count * count) > slit->header.length) {
+        kprintf(KP_WARNING, "acpi: SLIT locality matrix is truncated");
+        slit = NULL;
+        return;
+    }
+
+    /* Matrix rows and columns are indexed
+     * with proximity domains, not node numbers */
+    for(i = 0; i < count; ++i) {
+        for(j = 0; j < count; ++j) {
+            numa_set_distance(i, j, matrix[i * count + j]);
+        }
+    }
+}
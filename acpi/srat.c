@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <acpi/srat.h>
+#include <kern/printf.h>
+#include <mm/numa.h>
+
+const struct acpi_srat *srat = NULL;
+
+void init_srat(void)
+{
+    uint32_t domain;
+    uintptr_t base, length;
+    const uint8_t *itr;
+    const uint8_t *endptr;
+    const struct srat_header *header;
+    const struct srat_local_apic *lapic;
+    const struct srat_memory *memory;
+    const struct srat_local_x2apic *x2apic;
+
+    if((srat = acpi_lookup("SRAT")) == NULL) {
+        kprintf(KP_INFORM, "acpi: SRAT table is not present");
+        return;
+    }
+
+    if(acpi_sdt_checksum(srat)) {
+        kprintf(KP_WARNING, "acpi: SRAT failed checksum validation");
+        srat = NULL;
+        return;
+    }
+
+    /* Using index of one points at
+     * space right after the very last
+     * field defined in the structure */
+    itr = (const uint8_t *)(&srat[1]);
+    endptr = &((const uint8_t *)srat)[srat->header.length];
+
+    while((itr + sizeof(struct srat_header)) <= endptr) {
+        header = (const struct srat_header *)itr;
+
+        if(header->length < sizeof(struct srat_header))
+            break;
+
+        switch(header->type) {
+            case SRAT_LOCAL_APIC:
+                lapic = (const struct srat_local_apic *)itr;
+                if(!(lapic->flags & SRAT_LOCAL_APIC_ENABLED))
+                    break;
+                domain = lapic->domain_lo;
+                domain |= (uint32_t)lapic->domain_hi[0] << 8;
+                domain |= (uint32_t)lapic->domain_hi[1] << 16;
+                domain |= (uint32_t)lapic->domain_hi[2] << 24;
+                numa_add_cpu(domain, lapic->apic_id);
+                break;
+
+            case SRAT_MEMORY:
+                memory = (const struct srat_memory *)itr;
+                if(!(memory->flags & SRAT_MEMORY_ENABLED))
+                    break;
+                base = ((uintptr_t)memory->base_hi << 32) | memory->base_lo;
+                length = ((uintptr_t)memory->length_hi << 32) | memory->length_lo;
+                numa_add_memrange(memory->domain, base, length);
+                break;
+
+            case SRAT_LOCAL_X2APIC:
+                x2apic = (const struct srat_local_x2apic *)itr;
+                if(!(x2apic->flags & SRAT_LOCAL_APIC_ENABLED))
+                    break;
+                numa_add_cpu(x2apic->domain, x2apic->x2apic_id);
+                break;
+        }
+
+        itr += header->length;
+    }
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_ARCH_CPUID_H
+#define INCLUDE_ARCH_CPUID_H
+#include <kern/compiler.h>
+#include <stdint.h>
+
+struct cpuid {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+
+static __always_inline inline void cpuid(uint32_t leaf, uint32_t subleaf, struct cpuid *restrict regs)
+{
+    asm volatile("cpuid":"=a"(regs->eax), "=b"(regs->ebx), "=c"(regs->ecx), "=d"(regs->edx):"a"(leaf), "c"(subleaf));
+}
+
+static __always_inline __nodiscard inline uint32_t cpuid_apic_id(void)
+{
+    struct cpuid regs;
+    cpuid(0x00000001, 0, &regs);
+    return (regs.ebx >> 24) & 0xFF;
+}
+
+#endif /* INCLUDE_ARCH_CPUID_H */
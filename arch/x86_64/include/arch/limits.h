@@ -9,4 +9,6 @@
 #define PAGE_SHIFT 12
 #define PAGE_SIZE 0x1000
 
+#define CACHELINE_SIZE 64
+
 #endif /* INCLUDE_ARCH_LIMITS_H */
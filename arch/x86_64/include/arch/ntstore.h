@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_ARCH_NTSTORE_H
+#define INCLUDE_ARCH_NTSTORE_H
+#include <kern/compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Non-temporal stores bypass the cache hierarchy and
+ * don't evict anything useful; this is what we want when
+ * clearing memory that nobody is going to read soon. MOVNTI
+ * works on general purpose registers, so it is usable
+ * even with SSE disabled in the kernel */
+static __always_inline inline void ntstore_zero(void *restrict dst, size_t sz)
+{
+    uint64_t *ptr = dst;
+    uint64_t *end = (uint64_t *)((uintptr_t)dst + sz);
+
+    while(ptr < end) {
+        asm volatile(
+            "movnti %1, 0x00(%0)\n"
+            "movnti %1, 0x08(%0)\n"
+            "movnti %1, 0x10(%0)\n"
+            "movnti %1, 0x18(%0)\n"
+            "movnti %1, 0x20(%0)\n"
+            "movnti %1, 0x28(%0)\n"
+            "movnti %1, 0x30(%0)\n"
+            "movnti %1, 0x38(%0)\n"
+            ::"r"(ptr), "r"(UINT64_C(0)):"memory");
+        ptr += 8;
+    }
+}
+
+/* Non-temporal stores are weakly ordered and
+ * must be fenced before the memory is published */
+static __always_inline inline void ntstore_fence(void)
+{
+    asm volatile("sfence":::"memory");
+}
+
+#endif /* INCLUDE_ARCH_NTSTORE_H */
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #ifndef INCLUDE_ARCH_PAGING_H
 #define INCLUDE_ARCH_PAGING_H
+#include <arch/cpuid.h>
 #include <kern/compiler.h>
 #include <mm/vprot.h>
 #include <stdint.h>
@@ -9,6 +10,12 @@
 #define X86_PML_PRESENT 0x0000000000000001
 #define X86_PML_WRITE   0x0000000000000002
 #define X86_PML_USER    0x0000000000000004
+#define X86_PML_LARGE   0x0000000000000080
+#define X86_PML_GLOBAL  0x0000000000000100
+
+#define X86_CR3_NOFLUSH 0x8000000000000000
+#define X86_CR4_PGE     0x0000000000000080
+#define X86_CR4_PCIDE   0x0000000000020000
 #define X86_PML_NOEXEC  0x8000000000000000
 
 #define PMENTRY_LVL1_MASK UINT64_C(0x1FF)
@@ -23,12 +30,31 @@
 #define PMENTRY_LVL4_SHIFT UINT64_C(39)
 #define PMENTRY_LVL5_SHIFT UINT64_C(48)
 
+/* Page directory and PDPT entries can map
+ * 2 MiB and 1 GiB pages respectively; the latter
+ * is an optional feature reported by CPUID */
+#define PMENTRY_LEAF_LVL2 1
+#define PMENTRY_LEAF_LVL3 pagemap_has_lvl3_leaves()
+
+#define CPUID_80000001_EDX_PDPE1GB 0x04000000
+#define CPUID_00000001_ECX_PCID 0x00020000
+#define CPUID_00000001_EDX_PGE 0x00002000
+
+/* Zero is what the kernel's own pagemap uses */
+#define PAGEMAP_PCID_MAX 0xFFF
+
 #define PMENTRY_NULL UINT64_C(0x0000000000000000)
 
 #define PAGEMAP_SIZE 0x200
 #define PAGEMAP_KERN 0x100
 #define PAGEMAP_USER 0x000
 
+/* Large virtually contiguous kernel allocations
+ * live here; this is well past the end of the HHDM
+ * with both four and five level paging */
+#define VMALLOC_BASE UINT64_C(0xFFFFC90000000000)
+#define VMALLOC_SIZE UINT64_C(0x0000000040000000)
+
 #define PAGING_MODE_LVL3 LIMINE_PAGING_MODE_X86_64_4LVL
 #define PAGING_MODE_LVL4 LIMINE_PAGING_MODE_X86_64_4LVL
 #define PAGING_MODE_LVL5 LIMINE_PAGING_MODE_X86_64_5LVL
@@ -64,9 +90,105 @@ static __always_inline __nodiscard inline pmentry_t make_pmentry(uintptr_t addre
     return entry;
 }
 
+/* Large pages keep the PAT bit where 4 KiB pages
+ * keep their address; it is never set for either */
+static __always_inline __nodiscard inline pmentry_t make_pmentry_large(uintptr_t address, unsigned int vprot)
+{
+    return make_pmentry(address, vprot) | X86_PML_LARGE;
+}
+
+static __always_inline __nodiscard inline int pmentry_large(pmentry_t entry)
+{
+    return (entry & (X86_PML_PRESENT | X86_PML_LARGE)) == (X86_PML_PRESENT | X86_PML_LARGE);
+}
+
+static __always_inline __nodiscard inline pmentry_t pmentry_global(pmentry_t entry)
+{
+    return entry | X86_PML_GLOBAL;
+}
+
+static __always_inline __nodiscard inline int pagemap_has_lvl3_leaves(void)
+{
+    struct cpuid regs;
+    cpuid(0x80000001, 0, &regs);
+    return !!(regs.edx & CPUID_80000001_EDX_PDPE1GB);
+}
+
+static __always_inline __nodiscard inline int pagemap_has_global(void)
+{
+    struct cpuid regs;
+    cpuid(0x00000001, 0, &regs);
+    return !!(regs.edx & CPUID_00000001_EDX_PGE);
+}
+
+static __always_inline __nodiscard inline int pagemap_has_pcid(void)
+{
+    struct cpuid regs;
+    cpuid(0x00000001, 0, &regs);
+    return !!(regs.ecx & CPUID_00000001_ECX_PCID);
+}
+
+static __always_inline __nodiscard inline pmentry_t pmentry_remap(pmentry_t entry, uintptr_t address)
+{
+    return (entry & ~X86_PML_ADDRESS) | (X86_PML_ADDRESS & address);
+}
+
+/* The kernel half of the address space is the upper
+ * canonical half with both four and five level paging */
+static __always_inline __nodiscard inline int pagemap_is_kernel(uintptr_t virt)
+{
+    return (int)(virt >> 63);
+}
+
+static __always_inline inline void pagemap_invalidate(uintptr_t virt)
+{
+    asm volatile("invlpg (%0)"::"r"(virt):"memory");
+}
+
+static __always_inline inline void pagemap_flush(void)
+{
+    uintptr_t address;
+    asm volatile("movq %%cr3, %0":"=r"(address)::"memory");
+    asm volatile("movq %0, %%cr3"::"r"(address):"memory");
+}
+
+/* Toggling global pages off and back on drops
+ * everything, global entries and all PCIDs included */
+static __always_inline inline void pagemap_flush_global(void)
+{
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0":"=r"(cr4)::"memory");
+    asm volatile("movq %0, %%cr4"::"r"(cr4 & ~X86_CR4_PGE):"memory");
+    asm volatile("movq %0, %%cr4"::"r"(cr4):"memory");
+}
+
+static __always_inline inline void pagemap_enable_global(void)
+{
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0":"=r"(cr4)::"memory");
+    asm volatile("movq %0, %%cr4"::"r"(cr4 | X86_CR4_PGE):"memory");
+}
+
+/* Only allowed while the current PCID is zero */
+static __always_inline inline void pagemap_enable_pcid(void)
+{
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0":"=r"(cr4)::"memory");
+    asm volatile("movq %0, %%cr4"::"r"(cr4 | X86_CR4_PCIDE):"memory");
+}
+
 static __always_inline inline void pagemap_switch(uintptr_t address)
 {
     asm volatile("movq %0, %%cr3"::"r"(address):"memory");
 }
 
+/* Unless flush is set, whatever is cached
+ * for the PCID is kept across the switch */
+static __always_inline inline void pagemap_switch_pcid(uintptr_t address, unsigned int pcid, int flush)
+{
+    uint64_t cr3 = (address & X86_PML_ADDRESS) | pcid;
+    if(!flush) cr3 |= X86_CR3_NOFLUSH;
+    asm volatile("movq %0, %%cr3"::"r"(cr3):"memory");
+}
+
 #endif /* INCLUDE_ARCH_PAGING_H */
@@ -4,8 +4,10 @@
 #include <arch/intr.h>
 #include <kern/assert.h>
 #include <kern/panic.h>
+#include <mm/vmm.h>
 #include <stddef.h>
 #include <string.h>
+#include <vex/errno.h>
 
 #define IDT_SIZE 256
 
@@ -15,6 +17,12 @@
 #define IDT_RING_3  (0x03 << 5)
 #define IDT_PRESENT (0x01 << 7)
 
+#define X86_PF_PRESENT  0x0001
+#define X86_PF_WRITE    0x0002
+#define X86_PF_USER     0x0004
+#define X86_PF_RESERVED 0x0008
+#define X86_PF_IFETCH   0x0010
+
 struct idt_entry {
     uint16_t offset_0;
     uint16_t selector;
@@ -66,8 +74,43 @@ extern void x86_isr_1D(void);
 extern void x86_isr_1E(void);
 extern void x86_isr_1F(void);
 
+static void page_fault(const struct interrupt_frame *restrict frame)
+{
+    int r = EFAULT;
+    uintptr_t address;
+    unsigned int flags = 0;
+
+    asm volatile("movq %%cr2, %0":"=r"(address));
+
+    if(frame->error & X86_PF_PRESENT)
+        flags |= VMM_FAULT_PRESENT;
+    if(frame->error & X86_PF_WRITE)
+        flags |= VMM_FAULT_WRITE;
+    if(frame->error & X86_PF_IFETCH)
+        flags |= VMM_FAULT_EXEC;
+    if(frame->error & X86_PF_USER)
+        flags |= VMM_FAULT_USER;
+
+    /* Reserved bits mean the page tables are broken */
+    if(!(frame->error & X86_PF_RESERVED) && (r = vmm_fault(address, flags)) == 0)
+        return;
+
+    /* UNDONE: there are no user processes to
+     * kill yet, so any bad access is fatal for now */
+    disable_interrupts();
+    panic("idt: %s %s of %p at %p: %s", (frame->error & X86_PF_USER) ? "user" : "kernel",
+        (frame->error & X86_PF_IFETCH) ? "exec" : ((frame->error & X86_PF_WRITE) ? "write" : "read"),
+        (void *)address, (void *)frame->rip, strerror(r));
+    unreachable();
+}
+
 void __used x86_isr_handler(struct interrupt_frame *restrict frame, uint64_t intvec)
 {
+    if(intvec == 0x0E) {
+        page_fault(frame);
+        return;
+    }
+
     disable_interrupts();
     panic("idt: isr_handler %02zX", (size_t)intvec);
     unreachable();
@@ -140,7 +183,11 @@ void init_idt(void)
     set_idt_entry(0x0B, 1, &x86_isr_0B);
     set_idt_entry(0x0C, 1, &x86_isr_0C);
     set_idt_entry(0x0D, 1, &x86_isr_0D);
-    set_idt_entry(0x0E, 1, &x86_isr_0E);
+
+    /* Page faults are resolved with interrupts off
+     * since vmm_fault is not meant to be reentered */
+    set_idt_entry(0x0E, 0, &x86_isr_0E);
+
     set_idt_entry(0x0F, 1, &x86_isr_0F);
     set_idt_entry(0x10, 1, &x86_isr_10);
     set_idt_entry(0x11, 1, &x86_isr_11);
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_ACPI_SLIT_H
+#define INCLUDE_ACPI_SLIT_H
+#include <acpi/acpi.h>
+#include <stddef.h>
+
+#define SLIT_LOCAL_DISTANCE     10
+#define SLIT_REMOTE_DISTANCE    20
+#define SLIT_UNREACHABLE        0xFF
+
+struct acpi_slit {
+    struct acpi_sdt_header header;
+    uint64_t locality_count;
+} __packed;
+
+extern const struct acpi_slit *slit;
+
+/* SLIT is optional; without it every remote
+ * node is considered to be equally far away */
+void init_slit(void);
+
+#endif /* INCLUDE_ACPI_SLIT_H */
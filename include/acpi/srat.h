@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_ACPI_SRAT_H
+#define INCLUDE_ACPI_SRAT_H
+#include <acpi/acpi.h>
+#include <stddef.h>
+
+#define SRAT_LOCAL_APIC             UINT8_C(0x00)
+#define SRAT_MEMORY                 UINT8_C(0x01)
+#define SRAT_LOCAL_X2APIC           UINT8_C(0x02)
+
+#define SRAT_LOCAL_APIC_ENABLED     UINT32_C(0x00000001)
+#define SRAT_MEMORY_ENABLED         UINT32_C(0x00000001)
+#define SRAT_MEMORY_HOTPLUGGABLE    UINT32_C(0x00000002)
+#define SRAT_MEMORY_NONVOLATILE     UINT32_C(0x00000004)
+
+struct acpi_srat {
+    struct acpi_sdt_header header;
+    uint32_t reserved_1;
+    uint64_t reserved_2;
+} __packed;
+
+struct srat_header {
+    uint8_t type;
+    uint8_t length;
+} __packed;
+
+struct srat_local_apic {
+    struct srat_header header;
+    uint8_t domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_hi[3];
+    uint32_t clock_domain;
+} __packed;
+
+struct srat_memory {
+    struct srat_header header;
+    uint32_t domain;
+    uint16_t reserved_1;
+    uint32_t base_lo;
+    uint32_t base_hi;
+    uint32_t length_lo;
+    uint32_t length_hi;
+    uint32_t reserved_2;
+    uint32_t flags;
+    uint64_t reserved_3;
+} __packed;
+
+struct srat_local_x2apic {
+    struct srat_header header;
+    uint16_t reserved_1;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved_2;
+} __packed;
+
+extern const struct acpi_srat *srat;
+
+/* SRAT is optional; machines without it are
+ * treated as having a single NUMA node */
+void init_srat(void);
+
+#endif /* INCLUDE_ACPI_SRAT_H */
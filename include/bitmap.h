@@ -6,19 +6,31 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#if UINTPTR_MAX > UINT32_MAX
+#define BITMAP_BIT(bit) (UINT64_C(1) << ((uint64_t)bit))
+#define BITMAP_CHUNK_BITS 64
+#define BITMAP_MASK_CLEAR UINT64_C(0x0000000000000000)
+#define BITMAP_MASK_SET UINT64_C(0xFFFFFFFFFFFFFFFF)
+typedef uint64_t bitmap_t;
+#else
 #define BITMAP_BIT(bit) (UINT32_C(1) << ((uint32_t)bit))
-
 #define BITMAP_CHUNK_BITS 32
 #define BITMAP_MASK_CLEAR UINT32_C(0x00000000)
 #define BITMAP_MASK_SET UINT32_C(0xFFFFFFFF)
-
 typedef uint32_t bitmap_t;
+#endif
 
 int bitmap_range_isset(const bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b);
 int bitmap_range_isclear(const bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b);
 void bitmap_range_clear(bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b);
 void bitmap_range_set(bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b);
 
+/* Search functions look at bits [start, nbits) and
+ * return nbits when nothing satisfying was found */
+size_t bitmap_find_set(const bitmap_t *restrict bitmap, size_t nbits, size_t start);
+size_t bitmap_find_clear(const bitmap_t *restrict bitmap, size_t nbits, size_t start);
+size_t bitmap_find_run(const bitmap_t *restrict bitmap, size_t nbits, size_t start, size_t count);
+
 static __always_inline __nodiscard inline size_t bitmap_bytecount(size_t bits)
 {
     bits = align_ceil(bits, BITMAP_CHUNK_BITS);
@@ -35,21 +47,21 @@ static __always_inline __nodiscard inline int bitmap_isset(const bitmap_t *restr
 {
     size_t bdiv = bit / BITMAP_CHUNK_BITS;
     size_t bmod = bit % BITMAP_CHUNK_BITS;
-    return bitmap[bdiv] & BITMAP_BIT(BITMAP_CHUNK_BITS - bmod - 1);
+    return (bitmap[bdiv] & BITMAP_BIT(BITMAP_CHUNK_BITS - bmod - 1)) != 0;
 }
 
 static __always_inline inline void bitmap_clear(bitmap_t *restrict bitmap, size_t bit)
 {
     size_t bdiv = bit / BITMAP_CHUNK_BITS;
     size_t bmod = bit % BITMAP_CHUNK_BITS;
-    bitmap[bdiv] |= BITMAP_BIT(BITMAP_CHUNK_BITS - bmod - 1);
+    bitmap[bdiv] &= ~BITMAP_BIT(BITMAP_CHUNK_BITS - bmod - 1);
 }
 
 static __always_inline inline void bitmap_set(bitmap_t *restrict bitmap, size_t bit)
 {
     size_t bdiv = bit / BITMAP_CHUNK_BITS;
     size_t bmod = bit % BITMAP_CHUNK_BITS;
-    bitmap[bdiv] &= ~BITMAP_BIT(BITMAP_CHUNK_BITS - bmod - 1);
+    bitmap[bdiv] |= BITMAP_BIT(BITMAP_CHUNK_BITS - bmod - 1);
 }
 
 #endif /* INCLUDE_BITMAP_H */
@@ -50,6 +50,7 @@
 
 #define __alias(func)       __attribute__((alias(#func)))
 #define __align_as(type)    __attribute__((aligned(sizeof(type))))
+#define __aligned(x)        __attribute__((aligned(x)))
 #define __always_inline     __attribute__((always_inline))
 #define __nodiscard         __attribute__((warn_unused_result))
 #define __noreturn          __attribute__((noreturn))
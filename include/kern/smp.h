@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_KERN_SMP_H
+#define INCLUDE_KERN_SMP_H
+#include <kern/compiler.h>
+
+#if !defined(MAX_CPUS)
+#define MAX_CPUS 64
+#endif
+
+/* UNDONE: there is no application processor
+ * bring-up code yet, so everything runs on the BSP;
+ * per-CPU data is indexed with this value already */
+static __always_inline __nodiscard inline unsigned int smp_cpu_index(void)
+{
+    return 0;
+}
+
+#endif /* INCLUDE_KERN_SMP_H */
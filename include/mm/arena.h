@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_MM_ARENA_H
+#define INCLUDE_MM_ARENA_H
+#include <kern/compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct arena_chunk;
+
+/* Objects allocated from an arena are never freed
+ * one by one; they all go away at once when the arena
+ * is rewound past them or released. A zeroed arena is
+ * empty and ready to use, so arenas can live on the stack */
+struct arena {
+    struct arena_chunk *ar_chunk;
+    uintptr_t ar_cursor;
+    uintptr_t ar_limit;
+};
+
+struct arena_mark {
+    struct arena_chunk *am_chunk;
+    uintptr_t am_cursor;
+};
+
+void *arena_alloc_slow(struct arena *restrict arena, size_t sz, size_t align);
+
+/* Allocations that do not fit into what is left of
+ * the current chunk chain a new one from the buddy
+ * allocator; alignment must be a power of two */
+static __always_inline __nodiscard inline void *arena_alloc(struct arena *restrict arena, size_t sz, size_t align)
+{
+    uintptr_t address = align_ceil(arena->ar_cursor, align);
+
+    if(predict_true((address >= arena->ar_cursor) && (address < arena->ar_limit) && (sz <= (arena->ar_limit - address)))) {
+        arena->ar_cursor = address + sz;
+        return (void *)address;
+    }
+
+    return arena_alloc_slow(arena, sz, align);
+}
+
+void *arena_calloc(struct arena *restrict arena, size_t count, size_t sz);
+
+/* Rewinding to a mark frees everything that was
+ * allocated after it was taken; marks taken after the
+ * one being rewound to become invalid */
+void arena_mark(const struct arena *restrict arena, struct arena_mark *restrict mark);
+void arena_rewind(struct arena *restrict arena, const struct arena_mark *restrict mark);
+void arena_release(struct arena *restrict arena);
+
+#endif /* INCLUDE_MM_ARENA_H */
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_MM_CMA_H
+#define INCLUDE_MM_CMA_H
+#include <kern/compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The CMA region is carved out of the buddy allocator
+ * as one block of this order at boot; 2^12 pages is 16 MiB */
+#if !defined(CMA_ORDER)
+#define CMA_ORDER 12
+#endif
+
+/* Single pages handed out by pmm_alloc_movable; these
+ * are evicted into the rest of memory by cma_alloc */
+uintptr_t cma_alloc_page(void);
+void cma_free_page(uintptr_t address);
+int cma_contains(uintptr_t address);
+
+/* Allocate a physically contiguous run of pages,
+ * migrating whatever movable pages occupy the region */
+uintptr_t cma_alloc(size_t npages);
+void *cma_alloc_hhdm(size_t npages);
+void cma_release(uintptr_t address, size_t npages);
+void cma_release_hhdm(void *restrict ptr, size_t npages);
+
+void init_cma(void);
+
+#endif /* INCLUDE_MM_CMA_H */
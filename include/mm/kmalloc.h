@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_MM_KMALLOC_H
+#define INCLUDE_MM_KMALLOC_H
+#include <arch/paging.h>
+#include <kern/compiler.h>
+#include <stddef.h>
+
+#define KM_CONTIG   0x0001U /* Physically contiguous */
+#define KM_ZERO     0x0002U /* Cleared to zero */
+
+/* Small sizes come from the slab allocator; larger
+ * ones are either mapped page by page into the vmalloc
+ * area or, with KM_CONTIG, taken from the buddy allocator */
+void *kmalloc(size_t sz, unsigned int flags);
+void kfree(void *restrict ptr);
+
+/* Resizes in place whenever the block would end up
+ * the same size class or page count anyway, otherwise
+ * copies the smaller of the two sizes over; flags only
+ * apply to the new block if one has to be allocated */
+void *krealloc(void *restrict ptr, size_t sz, unsigned int flags);
+
+/* Returns the number of bytes that
+ * are actually usable at the pointer */
+size_t ksize(const void *restrict ptr);
+
+static __always_inline __nodiscard inline int vmalloc_contains(const void *restrict ptr)
+{
+    return ((uintptr_t)ptr >= VMALLOC_BASE) && ((uintptr_t)ptr < (VMALLOC_BASE + VMALLOC_SIZE));
+}
+
+void init_kmalloc(void);
+
+#endif /* INCLUDE_MM_KMALLOC_H */
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_MM_MEMBLOCK_H
+#define INCLUDE_MM_MEMBLOCK_H
+#include <kern/compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(MEMBLOCK_MAX_REGIONS)
+#define MEMBLOCK_MAX_REGIONS 128
+#endif
+
+struct memblock_region {
+    uintptr_t mr_base;
+    uintptr_t mr_end;
+};
+
+struct memblock_iter {
+    size_t mi_memory;
+    size_t mi_reserved;
+    uintptr_t mi_cursor;
+};
+
+/* Both the usable memory and the reserved lists
+ * are kept sorted with adjacent regions merged */
+int memblock_add(uintptr_t base, size_t length);
+int memblock_reserve(uintptr_t base, size_t length);
+
+/* Allocations are carved from the top of the
+ * highest free range so that the low memory that
+ * is useful for DMA is left alone for as long as possible */
+uintptr_t memblock_alloc(size_t size, size_t align);
+void *memblock_alloc_hhdm(size_t size, size_t align);
+
+uintptr_t memblock_start(void);
+uintptr_t memblock_end(void);
+
+/* Walk the ranges of memory that are usable
+ * and not reserved; the iterator must be zeroed
+ * beforehand, returns zero once there's nothing left */
+int memblock_next_free(struct memblock_iter *restrict iter, uintptr_t *restrict start, uintptr_t *restrict end);
+
+/* Once the physical memory manager has taken over
+ * the free ranges, memblock stops handing out memory */
+void memblock_handover(void);
+
+void init_memblock(void);
+
+#endif /* INCLUDE_MM_MEMBLOCK_H */
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_MM_MIGRATE_H
+#define INCLUDE_MM_MIGRATE_H
+#include <kern/compiler.h>
+#include <stdint.h>
+
+/* Move the contents of a movable page to a freshly
+ * allocated one and point its mapping there; on success
+ * the old page is left without any references and it is
+ * up to the caller to decide what to do with it */
+int migrate_page(uintptr_t address);
+
+#endif /* INCLUDE_MM_MIGRATE_H */
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef INCLUDE_MM_NUMA_H
+#define INCLUDE_MM_NUMA_H
+#include <kern/compiler.h>
+#include <kern/smp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(MAX_NUMA_NODES)
+#define MAX_NUMA_NODES 8
+#endif
+
+#if !defined(MAX_NUMA_MEMRANGES)
+#define MAX_NUMA_MEMRANGES 64
+#endif
+
+struct numa_memrange {
+    uintptr_t nm_base;
+    uintptr_t nm_end;
+    unsigned int nm_node;
+};
+
+extern unsigned int numa_num_nodes;
+extern unsigned int numa_fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+int numa_add_cpu(uint32_t domain, uint32_t apic_id);
+int numa_add_memrange(uint32_t domain, uintptr_t base, uintptr_t length);
+void numa_set_distance(uint32_t domain_a, uint32_t domain_b, unsigned int distance);
+
+unsigned int numa_distance(unsigned int node_a, unsigned int node_b);
+unsigned int numa_cpu_node(unsigned int cpu);
+
+/* Returns the node the address belongs to and the
+ * end of the span of addresses that share that node; any
+ * address not described by SRAT belongs to the node zero */
+unsigned int numa_addr_to_node(uintptr_t address, uintptr_t *restrict limit);
+
+static __always_inline __nodiscard inline unsigned int numa_local_node(void)
+{
+    return numa_cpu_node(smp_cpu_index());
+}
+
+void init_numa(void);
+
+#endif /* INCLUDE_MM_NUMA_H */
@@ -6,6 +6,29 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define PG_BUDDY    0x0001U /* Head of a free buddy block */
+#define PG_RESERVED 0x0002U /* Never handed out */
+#define PG_MOVABLE  0x0004U /* Can be migrated elsewhere */
+#define PG_ISOLATED 0x0008U /* Taken off the free lists by compaction */
+#define PG_SLAB     0x0010U /* Belongs to a slab cache */
+#define PG_LARGE    0x0020U /* First page of a large kmalloc block */
+
+/* Every page frame in the system has one of
+ * these; the array is indexed by the frame number */
+struct page {
+    uint32_t pg_flags;
+    uint32_t pg_refcount;
+    uint8_t pg_order;
+    uint8_t pg_zone;
+    uint16_t pg_node;
+    uint32_t pg_private;
+    void *pg_owner;
+    uintptr_t pg_index;
+};
+
+extern struct page *page_array;
+extern size_t page_array_count;
+
 static __always_inline __nodiscard inline uintptr_t page_align(uintptr_t address)
 {
     return align_floor(address, PAGE_SIZE);
@@ -31,4 +54,19 @@ static __always_inline __nodiscard inline size_t page_count(size_t sz)
     return align_ceil(sz, PAGE_SIZE) / PAGE_SIZE;
 }
 
+static __always_inline __nodiscard inline int page_valid(uintptr_t address)
+{
+    return (address >> PAGE_SHIFT) < page_array_count;
+}
+
+static __always_inline __nodiscard inline struct page *phys_to_page(uintptr_t address)
+{
+    return &page_array[address >> PAGE_SHIFT];
+}
+
+static __always_inline __nodiscard inline uintptr_t page_to_phys(const struct page *restrict pg)
+{
+    return ((uintptr_t)(pg - page_array)) << PAGE_SHIFT;
+}
+
 #endif /* INCLUDE_MM_PAGE_H */
@@ -9,16 +9,139 @@
 #define DMA_APPROX_END 0x3FFFFFF
 #endif
 
+/* The DMA zone is managed by the bitmap allocator
+ * and is shared by all nodes; the other two zones are
+ * managed by per-node instances of the buddy allocator */
+#define ZONE_DMA    0
+#define ZONE_DMA32  1
+#define ZONE_NORMAL 2
+#define MAX_ZONES   3
+
+#define ZONE_DMA32_END UINT64_C(0xFFFFFFFF)
+
+#define PMM_DMA32       0x0001U /* Don't allocate above 4 GiB */
+#define PMM_THISNODE    0x0002U /* Don't fall back to other nodes */
+
+/* Largest buddy allocator block is 2^PMM_MAX_ORDER
+ * pages, which is exactly 1 GiB with 4 KiB pages */
+#define PMM_MAX_ORDER 18
+
+/* Huge pages are 2 MiB, which is what compaction
+ * tries to reassemble out of fragmented memory */
+#define PMM_HUGE_ORDER 9
+#define PMM_HUGE_PAGES (UINT64_C(1) << PMM_HUGE_ORDER)
+
+/* Maximum number of free memory extents that are
+ * carved into buddy allocator blocks lazily; anything
+ * beyond that is seeded into the allocator at boot time */
+#if !defined(PMM_MAX_EXTENTS)
+#define PMM_MAX_EXTENTS 128
+#endif
+
+/* Per-CPU page caches are refilled from and drained
+ * into the buddy allocator in batches of 2^PMM_PCP_ORDER
+ * pages and can hold up to four such batches at once */
+#if !defined(PMM_PCP_ORDER)
+#define PMM_PCP_ORDER 5
+#endif
+#define PMM_PCP_BATCH (1 << PMM_PCP_ORDER)
+#define PMM_PCP_SIZE (PMM_PCP_BATCH * 4)
+
+/* Maximum number of pre-zeroed pages each CPU keeps */
+#if !defined(PMM_ZERO_POOL_SIZE)
+#define PMM_ZERO_POOL_SIZE 64
+#endif
+
+struct pmm_stats {
+    size_t ps_present;
+    size_t ps_free;
+};
+
+/* Shrinkers are called when the buddy allocator
+ * runs dry to let caches give some memory back; they
+ * return the number of pages they managed to release */
+struct pmm_shrinker {
+    size_t (*sh_func)(void);
+    struct pmm_shrinker *sh_next;
+};
+
+struct pmm_compact_stats {
+    size_t cs_blocks_scanned;
+    size_t cs_blocks_recovered;
+    size_t cs_pages_moved;
+    size_t cs_failures;
+};
+
 uintptr_t dma_alloc(size_t npages);
 void *dma_alloc_hhdm(size_t npages);
+
+/* Allocate a run of pages that starts at a multiple
+ * of align bytes, does not cross a multiple of boundary
+ * bytes and ends at or below max_phys; both align and
+ * boundary must be powers of two, zero means "don't care" */
+uintptr_t dma_alloc_constrained(size_t npages, size_t align, size_t boundary, uintptr_t max_phys);
+void *dma_alloc_constrained_hhdm(size_t npages, size_t align, size_t boundary, uintptr_t max_phys);
 void dma_free(uintptr_t address, size_t npages);
 void dma_free_hhdm(void *restrict ptr, size_t npages);
 
+uintptr_t pmm_alloc_node(unsigned int node, unsigned int order, unsigned int flags);
+uintptr_t pmm_alloc_order(unsigned int order);
+void *pmm_alloc_order_hhdm(unsigned int order);
+void pmm_free_order(uintptr_t address, unsigned int order);
+void pmm_free_order_hhdm(void *restrict ptr, unsigned int order);
+
 uintptr_t pmm_alloc(void);
 void *pmm_alloc_hhdm(void);
 void pmm_free(uintptr_t address);
 void pmm_free_hhdm(void *restrict ptr);
 
+/* Cold pages are not expected to be cache-warm
+ * and are the first ones to go back to the buddy */
+void pmm_free_cold(uintptr_t address);
+
+/* Gives everything cached by the calling CPU,
+ * including its pre-zeroed pool, back to the buddy */
+void pmm_drain_local(void);
+
+/* Zeroed pages come from a per-CPU pool of pages
+ * cleared ahead of time by pmm_zero_worker, which is
+ * run at boot and whenever the VMM releases memory; it
+ * returns the number of pages cleared */
+uintptr_t pmm_alloc_zeroed(void);
+void *pmm_alloc_zeroed_hhdm(void);
+size_t pmm_zero_worker(size_t budget);
+
+/* Movable pages may be migrated elsewhere as long
+ * as they are only accessed through a single mapping
+ * established with vmm_map; the HHDM alias is off limits */
+uintptr_t pmm_alloc_movable(void);
+
+/* Reference counting; a page returns to
+ * the allocator once the last reference is gone */
+void pmm_page_get(uintptr_t address);
+void pmm_page_put(uintptr_t address);
+
+/* Parts of the struct page array are only zeroed once
+ * the memory they describe is handed to the buddy; until
+ * then the entries are garbage and must not be touched */
+int pmm_page_initialized(uintptr_t address);
+
+/* Free page counts do not include pages
+ * sitting in the per-CPU caches; these are
+ * reported separately by pmm_cached_pages */
+int pmm_get_stats(unsigned int node, unsigned int type, struct pmm_stats *restrict stats);
+size_t pmm_cached_pages(void);
+void pmm_print_stats(void);
+
+/* Compaction migrates movable pages out of fragmented
+ * 2 MiB blocks until they coalesce; it runs on demand when
+ * a huge page allocation fails, and pmm_compact is meant to
+ * be run in the background with a budget of blocks to scan;
+ * it returns the number of 2 MiB blocks recovered */
+size_t pmm_compact(size_t budget);
+void pmm_register_shrinker(struct pmm_shrinker *restrict shrinker);
+void pmm_compact_stats(struct pmm_compact_stats *restrict stats);
+
 void init_pmm(void);
 
 #endif /* INCLUDE_MM_PMM_H */
@@ -1,13 +1,98 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #ifndef INCLUDE_MM_SLAB_H
 #define INCLUDE_MM_SLAB_H
+#include <arch/limits.h>
 #include <kern/compiler.h>
 #include <stddef.h>
 
+/* Redzones, poisoning, double free detection and
+ * caller tracking; only ever enabled at build time */
+#if !defined(SLAB_DEBUG)
+#define SLAB_DEBUG 0
+#endif
+
+/* Anything larger than this is up to kmalloc */
+#define SLAB_MAX_SIZE (PAGE_SIZE / 4)
+
+/* Each CPU keeps two magazines of free objects per
+ * cache and trades them for full or empty ones with the
+ * cache's depot; only the first SLAB_MAX_CACHES caches
+ * get a magazine layer, the rest go straight to slabs */
+#if !defined(SLAB_MAGAZINE_SIZE)
+#define SLAB_MAGAZINE_SIZE 15
+#endif
+#if !defined(SLAB_MAX_CACHES)
+#define SLAB_MAX_CACHES 64
+#endif
+
+/* Empty slab pages a cache holds on to before
+ * giving them back to the physical memory manager */
+#if !defined(SLAB_EMPTY_WATERMARK)
+#define SLAB_EMPTY_WATERMARK 2
+#endif
+
+/* Distinct call sites the allocation profiler
+ * can tell apart; samples from any more are dropped */
+#if !defined(SLAB_PROFILE_SITES)
+#define SLAB_PROFILE_SITES 256
+#endif
+
+struct kmem_cache;
+
+struct slab_stats {
+    size_t ss_allocs;
+    size_t ss_frees;
+    size_t ss_active;
+    size_t ss_pages;
+    size_t ss_failures;
+};
+
+/* Objects are constructed once when a slab page
+ * is populated and are expected to be handed back
+ * to the cache in their constructed state */
+typedef void (*kmem_ctor_t)(void *restrict ptr);
+
+struct kmem_cache *kmem_cache_create(const char *restrict name, size_t size, size_t align, kmem_ctor_t ctor);
+void kmem_cache_destroy(struct kmem_cache *restrict cache);
+void *kmem_cache_alloc(struct kmem_cache *restrict cache);
+void kmem_cache_free(struct kmem_cache *restrict cache, void *restrict ptr);
+
+/* Flush the depot and give every empty slab page
+ * back; both return the number of pages released */
+size_t kmem_cache_shrink(struct kmem_cache *restrict cache);
+size_t slab_shrink(void);
+
+/* Print cache geometry; with SLAB_DEBUG
+ * every live object and its caller is listed too */
+void kmem_cache_dump(const struct kmem_cache *restrict cache);
+void slab_dump(void);
+
+/* Counters are kept per CPU and only summed up
+ * here, so the result is a snapshot at best */
+void kmem_cache_get_stats(const struct kmem_cache *restrict cache, struct slab_stats *restrict stats);
+void slab_print_stats(void);
+
+/* Once started, a call site is sampled every time
+ * another rate bytes have been allocated on a CPU;
+ * starting again with a new rate clears the samples */
+int slab_profile_start(size_t rate);
+void slab_profile_stop(void);
+void slab_profile_sample(size_t sz, void *restrict caller);
+void slab_profile_dump(void);
+
 void *slab_alloc(size_t sz);
+
+/* Charges the allocation to caller instead, for
+ * wrappers like kmalloc that are not the real call site */
+void *slab_alloc_caller(size_t sz, void *restrict caller);
 void *slab_calloc(size_t count, size_t sz);
 void *slab_realloc(void *restrict ptr, size_t sz);
 void slab_free(void *restrict ptr);
+size_t slab_size(const void *restrict ptr);
+
+/* Object size of the class a request of sz
+ * bytes ends up in, zero if there is no such class */
+size_t slab_class_size(size_t sz);
 
 void init_slab(void);
 
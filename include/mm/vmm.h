@@ -2,14 +2,67 @@
 #ifndef INCLUDE_MM_VMM_H
 #define INCLUDE_MM_VMM_H
 #include <arch/paging.h>
+#include <bitmap.h>
 #include <kern/compiler.h>
+#include <kern/smp.h>
 #include <mm/vprot.h>
 
+/* Invalidating more pages than this at once
+ * reloads the whole TLB instead of going one by one */
+#if !defined(VMM_FLUSH_THRESHOLD)
+#define VMM_FLUSH_THRESHOLD 32
+#endif
+
+/* Pages freed by an unmap are only given back
+ * once they are flushed; this many are held at most */
+#if !defined(VMM_GATHER_FRAMES)
+#define VMM_GATHER_FRAMES 64
+#endif
+
+#define VMA_ANON 0x0001U /* Zero-filled on first touch */
+
+#define VMM_FAULT_PRESENT   0x0001U /* The page was mapped */
+#define VMM_FAULT_WRITE     0x0002U
+#define VMM_FAULT_EXEC      0x0004U
+#define VMM_FAULT_USER      0x0008U
+
+#define VMM_CPUMASK_CHUNKS ((MAX_CPUS + BITMAP_CHUNK_BITS - 1) / BITMAP_CHUNK_BITS)
+
+/* Areas are kept sorted and never overlap */
+struct vm_area {
+    uintptr_t va_start;
+    uintptr_t va_end;
+    unsigned int va_prot;
+    unsigned int va_flags;
+    struct vm_area *va_next;
+};
+
 struct pagemap {
+    struct vm_area *vm_areas;
     pmentry_t *vm_virt;
     uintptr_t vm_phys;
+    bitmap_t vm_active[VMM_CPUMASK_CHUNKS];
+    bitmap_t vm_stale[VMM_CPUMASK_CHUNKS];
+    unsigned int vm_pcid;
+    size_t vm_generation;
 };
 
+/* Invalidations are collected while page table
+ * entries are changed and then done all at once; once
+ * there are too many addresses only the count is kept */
+struct vmm_gather {
+    struct pagemap *vg_vm;
+    size_t vg_count;
+    int vg_kernel;
+    uintptr_t vg_pages[VMM_FLUSH_THRESHOLD];
+    size_t vg_nframes;
+    uintptr_t vg_frames[VMM_GATHER_FRAMES];
+};
+
+/* Asks every CPU in targets to run vmm_gather_flush_local
+ * on the gather and waits for all of them to be done with it */
+typedef void (*vmm_shootdown_t)(const struct vmm_gather *restrict gather, const bitmap_t *restrict targets);
+
 extern struct pagemap sys_vm;
 
 struct pagemap *vmm_create(void);
@@ -17,9 +70,56 @@ struct pagemap *vmm_fork(struct pagemap *restrict stem);
 void vmm_destroy(struct pagemap *restrict vm);
 void vmm_switch(struct pagemap *restrict vm);
 int vmm_map(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, unsigned int vprot);
+
+/* Maps a single page of the given size, which
+ * is either PAGE_SIZE or one of the large page sizes
+ * the hardware supports; both addresses must be aligned */
+int vmm_map_large(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, unsigned int vprot, size_t size);
+
+/* Large pages can only be patched
+ * or unmapped by their first address */
 int vmm_patch(struct pagemap *restrict vm, uintptr_t virt, unsigned int vprot);
 int vmm_unmap(struct pagemap *restrict vm, uintptr_t virt);
 
+/* Large pages are used wherever both addresses are
+ * aligned enough; mapping fails as a whole if anything
+ * in the range is already mapped. Unmapping and patching
+ * skip the holes but won't split a large page that sticks out */
+int vmm_map_range(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, size_t size, unsigned int vprot);
+int vmm_unmap_range(struct pagemap *restrict vm, uintptr_t virt, size_t size);
+int vmm_patch_range(struct pagemap *restrict vm, uintptr_t virt, size_t size, unsigned int vprot);
+
+/* Same as vmm_unmap_range but also hands the pages
+ * back to the PMM once nothing can reach them anymore */
+int vmm_unmap_range_free(struct pagemap *restrict vm, uintptr_t virt, size_t size);
+
+int vmm_translate(struct pagemap *restrict vm, uintptr_t virt, uintptr_t *restrict phys);
+
+/* Point an existing mapping at another
+ * physical page, keeping its protection as is */
+int vmm_remap(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys);
+
+void vmm_gather_begin(struct vmm_gather *restrict gather, struct pagemap *restrict vm);
+void vmm_gather_page(struct vmm_gather *restrict gather, uintptr_t virt);
+void vmm_gather_frame(struct vmm_gather *restrict gather, uintptr_t phys);
+void vmm_gather_flush_local(const struct vmm_gather *restrict gather);
+void vmm_gather_finish(struct vmm_gather *restrict gather);
+
+/* There is nobody to shoot down until application
+ * processors are brought up, whatever does that is also
+ * expected to install the IPI sending hook here */
+void vmm_set_shootdown(vmm_shootdown_t func);
+
+/* Reserved address space gets populated by the
+ * fault handler; nothing is mapped up front. Releasing
+ * trims or splits the areas and frees what was faulted in */
+int vmm_reserve(struct pagemap *restrict vm, uintptr_t virt, size_t size, unsigned int vprot, unsigned int flags);
+int vmm_release(struct pagemap *restrict vm, uintptr_t virt, size_t size);
+
+/* Resolves a fault in the pagemap the address belongs
+ * to; EFAULT and EACCES mean that the access was bad */
+int vmm_fault(uintptr_t virt, unsigned int flags);
+
 void init_vmm(void);
 
 #endif /* INCLUDE_MM_VMM_H */
@@ -7,6 +7,7 @@
 const void *memchr(const void *restrict buf, int chr, size_t sz) __nodiscard;
 int memcmp(const void *restrict ba, const void *restrict bb, size_t sz) __nodiscard;
 void *memcpy(void *restrict dst, const void *restrict src, size_t sz);
+void *memmove(void *dst, const void *src, size_t sz);
 void *memset(void *restrict dst, int chr, size_t sz);
 
 char *strcat(char *restrict dst, const char *restrict src);
@@ -1,15 +1,21 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include <acpi/acpi.h>
 #include <acpi/madt.h>
+#include <acpi/slit.h>
+#include <acpi/srat.h>
 #include <arch/setup.h>
 #include <kern/assert.h>
 #include <kern/fbcon.h>
 #include <kern/panic.h>
 #include <kern/printf.h>
 #include <kern/version.h>
+#include <mm/cma.h>
 #include <mm/hhdm.h>
 #include <mm/kbase.h>
+#include <mm/kmalloc.h>
+#include <mm/memblock.h>
 #include <mm/memmap.h>
+#include <mm/numa.h>
 #include <mm/pmm.h>
 #include <mm/slab.h>
 #include <mm/vmm.h>
@@ -23,15 +29,27 @@ void __noreturn __used kmain(void)
     init_hhdm();
     init_kbase();
     init_memmap();
+    init_memblock();
 
     init_acpi();
     init_madt();
+    init_srat();
+    init_slit();
+
+    init_numa();
 
     init_arch();
 
     init_pmm();
+    init_cma();
     init_slab();
     init_vmm();
+    init_kmalloc();
+
+    /* Stock up the zeroed pool while nothing
+     * is waiting on it yet; releasing memory
+     * through the VMM keeps it topped up later on */
+    pmm_zero_worker(PMM_ZERO_POOL_SIZE);
 
     init_fbcon();
 
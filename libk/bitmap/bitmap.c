@@ -1,95 +1,88 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include <bitmap.h>
 
-static __always_inline __nodiscard inline bitmap_t make_bitmask(size_t bitmod)
+/* Bits are numbered starting from the most
+ * significant bit of each chunk; this makes the mask
+ * of all bits starting at a specific one a plain shift */
+static __always_inline __nodiscard inline bitmap_t make_headmask(size_t bitmod)
 {
-    if(bitmod == 0)
-        return BITMAP_MASK_SET;
-    return ((1 << (BITMAP_CHUNK_BITS - bitmod)) - 1);
+    return BITMAP_MASK_SET >> bitmod;
+}
+
+/* Mask of all bits up to and including a specific one;
+ * shifting twice keeps the shift count below the chunk width */
+static __always_inline __nodiscard inline bitmap_t make_tailmask(size_t bitmod)
+{
+    return ~((BITMAP_MASK_SET >> 1) >> bitmod);
+}
+
+static __always_inline __nodiscard inline size_t chunk_clz(bitmap_t chunk)
+{
+#if BITMAP_CHUNK_BITS == 64
+    return (size_t)__builtin_clzll(chunk);
+#else
+    return (size_t)__builtin_clz(chunk);
+#endif
 }
 
 int bitmap_range_isset(const bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b)
 {
     size_t i;
-    size_t idx_a = align_floor(bit_a, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
-    size_t idx_b = align_floor(bit_b, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
+    size_t idx_a = bit_a / BITMAP_CHUNK_BITS;
+    size_t idx_b = bit_b / BITMAP_CHUNK_BITS;
 
-    bitmap_t mask_a = make_bitmask(bit_a % BITMAP_CHUNK_BITS);
-    bitmap_t mask_b = ~make_bitmask((bit_a + 1) % BITMAP_CHUNK_BITS);
+    bitmap_t mask_a = make_headmask(bit_a % BITMAP_CHUNK_BITS);
+    bitmap_t mask_b = make_tailmask(bit_b % BITMAP_CHUNK_BITS);
     bitmap_t mask_ab = mask_a & mask_b;
 
-    if(idx_a == idx_b) {
-        if((bitmap[idx_a] & mask_ab) == mask_ab)
-            return 1;
-        return 0;
-    }
+    if(idx_a == idx_b)
+        return (bitmap[idx_a] & mask_ab) == mask_ab;
 
-    for(i = idx_a; i <= idx_b; ++i) {
-        if(i == idx_a) {
-            if((bitmap[i] & mask_a) == mask_a)
-                continue;
-            return 0;
-        }
-
-        if(i == idx_b) {
-            if((bitmap[i] & mask_b) == mask_b)
-                continue;
-            return 0;
-        }
+    if((bitmap[idx_a] & mask_a) != mask_a)
+        return 0;
 
+    for(i = idx_a + 1; i < idx_b; ++i) {
         if(bitmap[i] == BITMAP_MASK_SET)
             continue;
         return 0;
     }
 
-    return 1;
+    return (bitmap[idx_b] & mask_b) == mask_b;
 }
 
 int bitmap_range_isclear(const bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b)
 {
     size_t i;
-    size_t idx_a = align_floor(bit_a, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
-    size_t idx_b = align_floor(bit_b, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
+    size_t idx_a = bit_a / BITMAP_CHUNK_BITS;
+    size_t idx_b = bit_b / BITMAP_CHUNK_BITS;
 
-    bitmap_t mask_a = make_bitmask(bit_a % BITMAP_CHUNK_BITS);
-    bitmap_t mask_b = ~make_bitmask((bit_a + 1) % BITMAP_CHUNK_BITS);
+    bitmap_t mask_a = make_headmask(bit_a % BITMAP_CHUNK_BITS);
+    bitmap_t mask_b = make_tailmask(bit_b % BITMAP_CHUNK_BITS);
     bitmap_t mask_ab = mask_a & mask_b;
 
-    if(idx_a == idx_b) {
-        if((bitmap[idx_a] & ~mask_ab) == bitmap[idx_a])
-            return 1;
-        return 0;
-    }
-
-    for(i = idx_a; i <= idx_b; ++i) {
-        if(i == idx_a) {
-            if((bitmap[i] & ~mask_a) == bitmap[i])
-                continue;
-            return 0;
-        }
+    if(idx_a == idx_b)
+        return (bitmap[idx_a] & mask_ab) == BITMAP_MASK_CLEAR;
 
-        if(i == idx_b) {
-            if((bitmap[i] & ~mask_b) == bitmap[i])
-                continue;
-            return 0;
-        }
+    if((bitmap[idx_a] & mask_a) != BITMAP_MASK_CLEAR)
+        return 0;
 
+    for(i = idx_a + 1; i < idx_b; ++i) {
         if(bitmap[i] == BITMAP_MASK_CLEAR)
             continue;
         return 0;
     }
 
-    return 1;
+    return (bitmap[idx_b] & mask_b) == BITMAP_MASK_CLEAR;
 }
 
 void bitmap_range_clear(bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b)
 {
     size_t i;
-    size_t idx_a = align_floor(bit_a, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
-    size_t idx_b = align_floor(bit_b, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
+    size_t idx_a = bit_a / BITMAP_CHUNK_BITS;
+    size_t idx_b = bit_b / BITMAP_CHUNK_BITS;
 
-    bitmap_t mask_a = make_bitmask(bit_a % BITMAP_CHUNK_BITS);
-    bitmap_t mask_b = ~make_bitmask((bit_a + 1) % BITMAP_CHUNK_BITS);
+    bitmap_t mask_a = make_headmask(bit_a % BITMAP_CHUNK_BITS);
+    bitmap_t mask_b = make_tailmask(bit_b % BITMAP_CHUNK_BITS);
     bitmap_t mask_ab = mask_a & mask_b;
 
     if(idx_a == idx_b) {
@@ -97,29 +90,22 @@ void bitmap_range_clear(bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b)
         return;
     }
 
-    for(i = idx_a; i <= idx_b; ++i) {
-        if(i == idx_a) {
-            bitmap[i] &= ~mask_a;
-            continue;
-        }
-
-        if(i == idx_b) {
-            bitmap[i] &= ~mask_b;
-            continue;
-        }
+    bitmap[idx_a] &= ~mask_a;
 
+    for(i = idx_a + 1; i < idx_b; ++i)
         bitmap[i] = BITMAP_MASK_CLEAR;
-    }
+
+    bitmap[idx_b] &= ~mask_b;
 }
 
 void bitmap_range_set(bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b)
 {
     size_t i;
-    size_t idx_a = align_floor(bit_a, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
-    size_t idx_b = align_floor(bit_b, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
+    size_t idx_a = bit_a / BITMAP_CHUNK_BITS;
+    size_t idx_b = bit_b / BITMAP_CHUNK_BITS;
 
-    bitmap_t mask_a = make_bitmask(bit_a % BITMAP_CHUNK_BITS);
-    bitmap_t mask_b = ~make_bitmask((bit_a + 1) % BITMAP_CHUNK_BITS);
+    bitmap_t mask_a = make_headmask(bit_a % BITMAP_CHUNK_BITS);
+    bitmap_t mask_b = make_tailmask(bit_b % BITMAP_CHUNK_BITS);
     bitmap_t mask_ab = mask_a & mask_b;
 
     if(idx_a == idx_b) {
@@ -127,17 +113,86 @@ void bitmap_range_set(bitmap_t *restrict bitmap, size_t bit_a, size_t bit_b)
         return;
     }
 
-    for(i = idx_a; i <= idx_b; ++i) {
-        if(i == idx_a) {
-            bitmap[i] |= mask_a;
-            continue;
-        }
-
-        if(i == idx_b) {
-            bitmap[i] |= mask_b;
-            continue;
-        }
+    bitmap[idx_a] |= mask_a;
 
+    for(i = idx_a + 1; i < idx_b; ++i)
         bitmap[i] = BITMAP_MASK_SET;
+
+    bitmap[idx_b] |= mask_b;
+}
+
+size_t bitmap_find_set(const bitmap_t *restrict bitmap, size_t nbits, size_t start)
+{
+    size_t bit;
+    size_t idx;
+    bitmap_t chunk;
+
+    if(start >= nbits)
+        return nbits;
+
+    idx = start / BITMAP_CHUNK_BITS;
+    chunk = bitmap[idx] & make_headmask(start % BITMAP_CHUNK_BITS);
+
+    /* Whole chunks with no bits set are
+     * skipped with a single comparison each */
+    while(chunk == BITMAP_MASK_CLEAR) {
+        if(++idx * BITMAP_CHUNK_BITS >= nbits)
+            return nbits;
+        chunk = bitmap[idx];
+    }
+
+    bit = idx * BITMAP_CHUNK_BITS + chunk_clz(chunk);
+    return (bit < nbits) ? bit : nbits;
+}
+
+size_t bitmap_find_clear(const bitmap_t *restrict bitmap, size_t nbits, size_t start)
+{
+    size_t bit;
+    size_t idx;
+    bitmap_t chunk;
+
+    if(start >= nbits)
+        return nbits;
+
+    idx = start / BITMAP_CHUNK_BITS;
+    chunk = ~bitmap[idx] & make_headmask(start % BITMAP_CHUNK_BITS);
+
+    while(chunk == BITMAP_MASK_CLEAR) {
+        if(++idx * BITMAP_CHUNK_BITS >= nbits)
+            return nbits;
+        chunk = ~bitmap[idx];
     }
+
+    bit = idx * BITMAP_CHUNK_BITS + chunk_clz(chunk);
+    return (bit < nbits) ? bit : nbits;
+}
+
+size_t bitmap_find_run(const bitmap_t *restrict bitmap, size_t nbits, size_t start, size_t count)
+{
+    size_t bit;
+    size_t limit;
+    size_t end;
+
+    if(count == 0)
+        return (start < nbits) ? start : nbits;
+
+    bit = start;
+
+    while(bit < nbits) {
+        if((bit = bitmap_find_set(bitmap, nbits, bit)) >= nbits)
+            break;
+
+        if(count > (nbits - bit))
+            break;
+        limit = bit + count;
+
+        /* The end of a run is the first clear bit
+         * after its beginning; if it comes before the run
+         * is long enough, the search resumes right there */
+        if((end = bitmap_find_clear(bitmap, limit, bit)) >= limit)
+            return bit;
+        bit = end;
+    }
+
+    return nbits;
 }
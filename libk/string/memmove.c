@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <string.h>
+
+void *memmove(void *dst, const void *src, size_t sz)
+{
+    unsigned char *dp = dst;
+    const unsigned char *sp = src;
+
+    if(dp < sp) {
+        while(sz--)
+            *dp++ = *sp++;
+        return dst;
+    }
+
+    dp += sz;
+    sp += sz;
+    while(sz--)
+        *--dp = *--sp;
+    return dst;
+}
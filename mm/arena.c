@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <arch/limits.h>
+#include <kern/assert.h>
+#include <mm/arena.h>
+#include <mm/pmm.h>
+#include <string.h>
+
+/* Every chunk is a buddy block that starts with
+ * this header; chunks are chained newest first */
+struct arena_chunk {
+    struct arena_chunk *ac_prev;
+    unsigned int ac_order;
+};
+
+static __always_inline __nodiscard inline uintptr_t chunk_limit(const struct arena_chunk *restrict chunk)
+{
+    return (uintptr_t)chunk + ((size_t)PAGE_SIZE << chunk->ac_order);
+}
+
+void *arena_alloc_slow(struct arena *restrict arena, size_t sz, size_t align)
+{
+    size_t offset;
+    unsigned int order;
+    struct arena_chunk *chunk;
+
+    kassert(align && !(align & (align - 1)));
+
+    offset = align_ceil(sizeof(struct arena_chunk), align);
+
+    if((offset < sizeof(struct arena_chunk)) || (sz > (SIZE_MAX - offset)))
+        return NULL;
+
+    for(order = 0; ((size_t)PAGE_SIZE << order) < (offset + sz); ++order) {
+        if(order >= PMM_MAX_ORDER) {
+            return NULL;
+        }
+    }
+
+    if((chunk = pmm_alloc_order_hhdm(order)) != NULL) {
+        chunk->ac_prev = arena->ar_chunk;
+        chunk->ac_order = order;
+
+        /* Whatever was left in the previous
+         * chunk is given up; it's reclaimed along
+         * with the chunk itself later on */
+        arena->ar_chunk = chunk;
+        arena->ar_cursor = (uintptr_t)chunk + offset + sz;
+        arena->ar_limit = chunk_limit(chunk);
+
+        return (void *)((uintptr_t)chunk + offset);
+    }
+
+    return NULL;
+}
+
+void *arena_calloc(struct arena *restrict arena, size_t count, size_t sz)
+{
+    void *ptr;
+
+    if(sz && (count > (SIZE_MAX / sz)))
+        return NULL;
+    if((ptr = arena_alloc(arena, count * sz, sizeof(void *))) == NULL)
+        return NULL;
+    return memset(ptr, 0, count * sz);
+}
+
+void arena_mark(const struct arena *restrict arena, struct arena_mark *restrict mark)
+{
+    mark->am_chunk = arena->ar_chunk;
+    mark->am_cursor = arena->ar_cursor;
+}
+
+void arena_rewind(struct arena *restrict arena, const struct arena_mark *restrict mark)
+{
+    struct arena_chunk *chunk;
+
+    while((chunk = arena->ar_chunk) != mark->am_chunk) {
+        kassert_msg(chunk != NULL, "arena: rewinding to a mark that is not in the arena");
+        arena->ar_chunk = chunk->ac_prev;
+        pmm_free_order_hhdm(chunk, chunk->ac_order);
+    }
+
+    if(chunk != NULL) {
+        arena->ar_cursor = mark->am_cursor;
+        arena->ar_limit = chunk_limit(chunk);
+        return;
+    }
+
+    arena->ar_cursor = 0;
+    arena->ar_limit = 0;
+}
+
+void arena_release(struct arena *restrict arena)
+{
+    struct arena_mark mark = { 0 };
+    arena_rewind(arena, &mark);
+}
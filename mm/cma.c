@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <bitmap.h>
+#include <iecprefix.h>
+#include <kern/assert.h>
+#include <kern/printf.h>
+#include <mm/cma.h>
+#include <mm/hhdm.h>
+#include <mm/migrate.h>
+#include <mm/numa.h>
+#include <mm/page.h>
+#include <mm/pmm.h>
+
+#define CMA_PAGES (UINT64_C(1) << CMA_ORDER)
+
+static bitmap_t cma_bitmap[(CMA_PAGES + BITMAP_CHUNK_BITS - 1) / BITMAP_CHUNK_BITS] = { 0 };
+static uintptr_t cma_base = 0;
+static size_t cma_numpages = 0;
+static size_t cma_lastpage = 0;
+
+static int cma_page_available(size_t page)
+{
+    const struct page *pg;
+
+    if(bitmap_isset(cma_bitmap, page))
+        return 1;
+    pg = phys_to_page(cma_base + page * PAGE_SIZE);
+    return (pg->pg_flags & PG_MOVABLE) && pg->pg_owner && (pg->pg_refcount == 1);
+}
+
+static int cma_claim(size_t page, size_t npages)
+{
+    int r;
+    size_t i;
+
+    for(i = page; i < (page + npages); ++i) {
+        if(bitmap_isset(cma_bitmap, i)) {
+            bitmap_clear(cma_bitmap, i);
+            continue;
+        }
+
+        if((r = migrate_page(cma_base + i * PAGE_SIZE)) != 0) {
+            /* Whatever has been claimed or migrated
+             * away so far is free memory by now */
+            if(i > page)
+                bitmap_range_set(cma_bitmap, page, i - 1);
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+uintptr_t cma_alloc_page(void)
+{
+    size_t page;
+
+    if((page = bitmap_find_set(cma_bitmap, cma_numpages, cma_lastpage)) >= cma_numpages) {
+        if((page = bitmap_find_set(cma_bitmap, cma_numpages, 0)) >= cma_numpages) {
+            return 0;
+        }
+    }
+
+    bitmap_clear(cma_bitmap, page);
+    cma_lastpage = page + 1;
+    return cma_base + page * PAGE_SIZE;
+}
+
+void cma_free_page(uintptr_t address)
+{
+    size_t page;
+
+    kassert(cma_contains(address));
+
+    page = (address - cma_base) / PAGE_SIZE;
+    bitmap_set(cma_bitmap, page);
+}
+
+int cma_contains(uintptr_t address)
+{
+    return (address >= cma_base) && (address < (cma_base + cma_numpages * PAGE_SIZE));
+}
+
+uintptr_t cma_alloc(size_t npages)
+{
+    size_t i;
+    size_t page;
+
+    if(npages == 0)
+        return 0;
+    page = 0;
+
+    while((page + npages) <= cma_numpages) {
+        for(i = page; i < (page + npages); ++i) {
+            if(!cma_page_available(i)) {
+                break;
+            }
+        }
+
+        if(i < (page + npages)) {
+            /* Any window that includes a
+             * pinned page is not going to work */
+            page = i + 1;
+            continue;
+        }
+
+        if(cma_claim(page, npages) == 0)
+            return cma_base + page * PAGE_SIZE;
+        page += 1;
+    }
+
+    return 0;
+}
+
+void *cma_alloc_hhdm(size_t npages)
+{
+    uintptr_t address;
+    if((address = cma_alloc(npages)) != 0)
+        return phys_to_hhdm(address);
+    return NULL;
+}
+
+void cma_release(uintptr_t address, size_t npages)
+{
+    size_t page;
+
+    kassert(cma_contains(address));
+    kassert(cma_contains(address + (npages - 1) * PAGE_SIZE));
+
+    page = (address - cma_base) / PAGE_SIZE;
+    bitmap_range_set(cma_bitmap, page, page + npages - 1);
+}
+
+void cma_release_hhdm(void *restrict ptr, size_t npages)
+{
+    cma_release(hhdm_to_phys(ptr), npages);
+}
+
+void init_cma(void)
+{
+    uintptr_t address;
+
+    /* The region is optional; without it movable
+     * allocations simply come from the buddy allocator */
+    if((address = pmm_alloc_node(numa_local_node(), CMA_ORDER, 0)) == 0) {
+        kprintf(KP_WARNING, "cma: unable to reserve %zu KiB", (size_t)((CMA_PAGES * PAGE_SIZE) >> KIBI));
+        return;
+    }
+
+    cma_base = address;
+    cma_numpages = CMA_PAGES;
+    cma_lastpage = 0;
+
+    bitmap_range_set(cma_bitmap, 0, cma_numpages - 1);
+
+    kprintf(KP_INFORM, "cma: reserved %zu KiB at %p", (size_t)((CMA_PAGES * PAGE_SIZE) >> KIBI), (void *)cma_base);
+}
@@ -0,0 +1,222 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <bitmap.h>
+#include <iecprefix.h>
+#include <kern/assert.h>
+#include <kern/panic.h>
+#include <kern/printf.h>
+#include <mm/hhdm.h>
+#include <mm/kmalloc.h>
+#include <mm/page.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <mm/vmm.h>
+#include <string.h>
+
+#define VMALLOC_PAGES (VMALLOC_SIZE / PAGE_SIZE)
+
+static bitmap_t *vmalloc_bitmap = NULL;
+static size_t vmalloc_lastpage = 0;
+
+static void *contig_alloc(size_t sz)
+{
+    size_t npages;
+    unsigned int order;
+    uintptr_t address;
+    struct page *pg;
+
+    npages = page_count(sz);
+
+    for(order = 0; (UINT64_C(1) << order) < npages; ++order) {
+        if(order >= PMM_MAX_ORDER) {
+            return NULL;
+        }
+    }
+
+    if((address = pmm_alloc_order(order)) != 0) {
+        pg = phys_to_page(address);
+        pg->pg_flags |= PG_LARGE;
+        pg->pg_private = npages;
+        return phys_to_hhdm(address);
+    }
+
+    return NULL;
+}
+
+static void contig_free(void *restrict ptr)
+{
+    uintptr_t address = hhdm_to_phys(ptr);
+    pmm_free_order(address, phys_to_page(address)->pg_order);
+}
+
+static void *vmalloc(size_t sz)
+{
+    size_t i;
+    size_t page;
+    size_t npages;
+    size_t limit;
+    uintptr_t phys;
+    uintptr_t virt;
+
+    if(vmalloc_bitmap == NULL)
+        return NULL;
+    npages = page_count(sz);
+
+    if(npages >= VMALLOC_PAGES)
+        return NULL;
+
+    /* Every block is followed by an unmapped guard
+     * page that catches running off the end of it */
+    page = bitmap_find_run(vmalloc_bitmap, VMALLOC_PAGES, vmalloc_lastpage, npages + 1);
+
+    if(page >= VMALLOC_PAGES) {
+        limit = vmalloc_lastpage + npages;
+        if(limit > VMALLOC_PAGES)
+            limit = VMALLOC_PAGES;
+        page = bitmap_find_run(vmalloc_bitmap, limit, 0, npages + 1);
+        if(page >= limit)
+            return NULL;
+    }
+
+    bitmap_range_clear(vmalloc_bitmap, page, page + npages);
+    vmalloc_lastpage = page + npages + 1;
+    virt = VMALLOC_BASE + page * PAGE_SIZE;
+
+    /* Pages are only ever accessed through this
+     * mapping so they might as well be movable */
+    for(i = 0; i < npages; ++i) {
+        if((phys = pmm_alloc_movable()) != 0) {
+            if(vmm_map(&sys_vm, virt + i * PAGE_SIZE, phys, VPROT_READ | VPROT_WRITE) == 0)
+                continue;
+            pmm_free(phys);
+        }
+
+        vmm_unmap_range_free(&sys_vm, virt, i * PAGE_SIZE);
+        bitmap_range_set(vmalloc_bitmap, page, page + npages);
+        return NULL;
+    }
+
+    kassert(vmm_translate(&sys_vm, virt, &phys) == 0);
+    phys_to_page(phys)->pg_flags |= PG_LARGE;
+    phys_to_page(phys)->pg_private = npages;
+
+    return (void *)virt;
+}
+
+static size_t vmalloc_npages(const void *restrict ptr)
+{
+    uintptr_t phys;
+
+    kassert(vmm_translate(&sys_vm, (uintptr_t)ptr, &phys) == 0);
+    kassert(phys_to_page(phys)->pg_flags & PG_LARGE);
+
+    return phys_to_page(phys)->pg_private;
+}
+
+static void vfree(void *restrict ptr)
+{
+    size_t page;
+    size_t npages;
+
+    kassert(!((uintptr_t)ptr & (PAGE_SIZE - 1)));
+
+    npages = vmalloc_npages(ptr);
+    page = ((uintptr_t)ptr - VMALLOC_BASE) / PAGE_SIZE;
+
+    vmm_unmap_range_free(&sys_vm, (uintptr_t)ptr, npages * PAGE_SIZE);
+    bitmap_range_set(vmalloc_bitmap, page, page + npages);
+}
+
+void *kmalloc(size_t sz, unsigned int flags)
+{
+    void *ptr;
+
+    if(sz <= SLAB_MAX_SIZE) {
+        ptr = slab_alloc_caller(sz, __builtin_return_address(0));
+    }
+    else {
+        if((flags & KM_CONTIG) || (sz <= PAGE_SIZE) || !(ptr = vmalloc(sz)))
+            ptr = contig_alloc(sz);
+        if(ptr != NULL)
+            slab_profile_sample(sz, __builtin_return_address(0));
+    }
+
+    if(ptr && (flags & KM_ZERO))
+        memset(ptr, 0, sz);
+    return ptr;
+}
+
+void kfree(void *restrict ptr)
+{
+    struct page *pg;
+
+    if(ptr == NULL)
+        return;
+
+    if(vmalloc_contains(ptr)) {
+        vfree(ptr);
+        return;
+    }
+
+    pg = phys_to_page(hhdm_to_phys(page_align_ptr(ptr)));
+
+    if(pg->pg_flags & PG_SLAB) {
+        slab_free(ptr);
+        return;
+    }
+
+    kassert_msg(pg->pg_flags & PG_LARGE, "kmalloc: freeing a pointer kmalloc did not hand out");
+    contig_free(ptr);
+}
+
+void *krealloc(void *restrict ptr, size_t sz, unsigned int flags)
+{
+    size_t oldsz;
+    void *newptr;
+
+    if(ptr == NULL)
+        return kmalloc(sz, flags);
+    oldsz = ksize(ptr);
+
+    if(oldsz <= SLAB_MAX_SIZE) {
+        if(slab_class_size(sz) == oldsz) {
+            return ptr;
+        }
+    }
+    else if((sz > SLAB_MAX_SIZE) && (page_count(sz) == page_count(oldsz))) {
+        return ptr;
+    }
+
+    if((newptr = kmalloc(sz, flags)) != NULL) {
+        memcpy(newptr, ptr, (sz < oldsz) ? sz : oldsz);
+        kfree(ptr);
+        return newptr;
+    }
+
+    return NULL;
+}
+
+size_t ksize(const void *restrict ptr)
+{
+    const struct page *pg;
+
+    if(vmalloc_contains(ptr))
+        return vmalloc_npages(ptr) * PAGE_SIZE;
+    pg = phys_to_page(hhdm_to_phys(page_align_const_ptr(ptr)));
+
+    if(pg->pg_flags & PG_SLAB)
+        return slab_size(ptr);
+    return pg->pg_private * PAGE_SIZE;
+}
+
+void init_kmalloc(void)
+{
+    if((vmalloc_bitmap = contig_alloc(bitmap_bytecount(VMALLOC_PAGES))) == NULL) {
+        panic("kmalloc: out of memory");
+        unreachable();
+    }
+
+    bitmap_range_set(vmalloc_bitmap, 0, VMALLOC_PAGES - 1);
+    vmalloc_lastpage = 0;
+
+    kprintf(KP_INFORM, "kmalloc: vmalloc area at %p, %zu MiB", (void *)VMALLOC_BASE, (size_t)(VMALLOC_SIZE >> MEBI));
+}
@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <iecprefix.h>
+#include <kern/assert.h>
+#include <kern/panic.h>
+#include <kern/printf.h>
+#include <mm/hhdm.h>
+#include <mm/memblock.h>
+#include <mm/memmap.h>
+#include <mm/page.h>
+#include <string.h>
+#include <vex/errno.h>
+
+struct memblock_type {
+    struct memblock_region mt_regions[MEMBLOCK_MAX_REGIONS];
+    size_t mt_count;
+};
+
+static struct memblock_type memory = { 0 };
+static struct memblock_type reserved = { 0 };
+static int handed_over = 0;
+
+static int region_insert(struct memblock_type *restrict type, uintptr_t base, uintptr_t end)
+{
+    size_t i, j;
+    struct memblock_region *region;
+
+    if(base >= end)
+        return 0;
+
+    /* Find the first region that either overlaps or
+     * touches the new one or that comes after it */
+    for(i = 0; i < type->mt_count; ++i) {
+        if(type->mt_regions[i].mr_end >= base) {
+            break;
+        }
+    }
+
+    if((i >= type->mt_count) || (type->mt_regions[i].mr_base > end)) {
+        if(type->mt_count >= MEMBLOCK_MAX_REGIONS)
+            return ENOMEM;
+        memmove(&type->mt_regions[i + 1], &type->mt_regions[i], (type->mt_count - i) * sizeof(struct memblock_region));
+        type->mt_regions[i].mr_base = base;
+        type->mt_regions[i].mr_end = end;
+        type->mt_count += 1;
+        return 0;
+    }
+
+    region = &type->mt_regions[i];
+
+    if(base < region->mr_base)
+        region->mr_base = base;
+    if(end > region->mr_end)
+        region->mr_end = end;
+
+    /* Swallow whatever regions the
+     * grown one now overlaps or touches */
+    for(j = i + 1; j < type->mt_count; ++j) {
+        if(type->mt_regions[j].mr_base > region->mr_end)
+            break;
+        if(type->mt_regions[j].mr_end > region->mr_end) {
+            region->mr_end = type->mt_regions[j].mr_end;
+        }
+    }
+
+    if(j > (i + 1)) {
+        memmove(&type->mt_regions[i + 1], &type->mt_regions[j], (type->mt_count - j) * sizeof(struct memblock_region));
+        type->mt_count -= j - i - 1;
+    }
+
+    return 0;
+}
+
+int memblock_add(uintptr_t base, size_t length)
+{
+    return region_insert(&memory, base, base + length);
+}
+
+int memblock_reserve(uintptr_t base, size_t length)
+{
+    return region_insert(&reserved, base, base + length);
+}
+
+uintptr_t memblock_alloc(size_t size, size_t align)
+{
+    size_t i, j;
+    uintptr_t base, end;
+
+    kassert(!handed_over);
+
+    if(size == 0)
+        return 0;
+    if(align < sizeof(uintptr_t))
+        align = sizeof(uintptr_t);
+
+    /* Walk the free ranges from the top; each usable
+     * region is split by the reserved ones that overlap it */
+    j = reserved.mt_count;
+
+    for(i = memory.mt_count; i-- > 0;) {
+        end = memory.mt_regions[i].mr_end;
+
+        while(end > memory.mt_regions[i].mr_base) {
+            while((j > 0) && (reserved.mt_regions[j - 1].mr_base >= end))
+                j -= 1;
+
+            base = memory.mt_regions[i].mr_base;
+
+            if((j > 0) && (reserved.mt_regions[j - 1].mr_end > base))
+                base = reserved.mt_regions[j - 1].mr_end;
+
+            if((base < end) && ((end - base) >= size) && (align_floor(end - size, align) >= base)) {
+                base = align_floor(end - size, align);
+
+                if(region_insert(&reserved, base, base + size))
+                    return 0;
+                return base;
+            }
+
+            if((j == 0) || (reserved.mt_regions[j - 1].mr_end <= memory.mt_regions[i].mr_base))
+                break;
+            end = reserved.mt_regions[j - 1].mr_base;
+        }
+    }
+
+    return 0;
+}
+
+void *memblock_alloc_hhdm(size_t size, size_t align)
+{
+    uintptr_t address;
+    if((address = memblock_alloc(size, align)) != 0)
+        return phys_to_hhdm(address);
+    return NULL;
+}
+
+uintptr_t memblock_start(void)
+{
+    if(memory.mt_count)
+        return memory.mt_regions[0].mr_base;
+    return 0;
+}
+
+uintptr_t memblock_end(void)
+{
+    if(memory.mt_count)
+        return memory.mt_regions[memory.mt_count - 1].mr_end;
+    return 0;
+}
+
+int memblock_next_free(struct memblock_iter *restrict iter, uintptr_t *restrict start, uintptr_t *restrict end)
+{
+    uintptr_t base;
+    const struct memblock_region *region;
+    const struct memblock_region *resv;
+
+    while(iter->mi_memory < memory.mt_count) {
+        region = &memory.mt_regions[iter->mi_memory];
+
+        base = region->mr_base;
+        if(iter->mi_cursor > base)
+            base = iter->mi_cursor;
+
+        if(base >= region->mr_end) {
+            iter->mi_memory += 1;
+            continue;
+        }
+
+        while((iter->mi_reserved < reserved.mt_count) && (reserved.mt_regions[iter->mi_reserved].mr_end <= base))
+            iter->mi_reserved += 1;
+        resv = NULL;
+        if(iter->mi_reserved < reserved.mt_count)
+            resv = &reserved.mt_regions[iter->mi_reserved];
+
+        if(resv && (resv->mr_base <= base)) {
+            iter->mi_cursor = resv->mr_end;
+            continue;
+        }
+
+        start[0] = base;
+        end[0] = region->mr_end;
+
+        if(resv && (resv->mr_base < end[0]))
+            end[0] = resv->mr_base;
+        iter->mi_cursor = end[0];
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void memblock_handover(void)
+{
+    handed_over = 1;
+}
+
+void init_memblock(void)
+{
+    size_t i;
+    size_t total;
+    struct limine_memmap_entry *entry;
+
+    memset(&memory, 0, sizeof(memory));
+    memset(&reserved, 0, sizeof(reserved));
+    handed_over = 0;
+
+    for(i = 0; i < memmap.response->entry_count; ++i) {
+        entry = memmap.response->entries[i];
+
+        if(entry->type != LIMINE_MEMMAP_USABLE)
+            continue;
+
+        if(memblock_add(entry->base, entry->length)) {
+            panic("memblock: too many memory regions");
+            unreachable();
+        }
+    }
+
+    /* Physical address zero is how the allocators
+     * signal failure so it can never be handed out */
+    memblock_reserve(0, PAGE_SIZE);
+
+    total = 0;
+    for(i = 0; i < memory.mt_count; ++i)
+        total += memory.mt_regions[i].mr_end - memory.mt_regions[i].mr_base;
+    kprintf(KP_INFORM, "memblock: %zu regions, %zu KiB usable", memory.mt_count, total >> KIBI);
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <mm/hhdm.h>
+#include <mm/migrate.h>
+#include <mm/page.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <string.h>
+#include <vex/errno.h>
+
+int migrate_page(uintptr_t address)
+{
+    int r;
+    uintptr_t target;
+    struct page *pg;
+    struct page *target_pg;
+
+    pg = phys_to_page(address);
+
+    /* Pages without a known owner mapping are pinned
+     * by whoever holds the physical address; the same goes
+     * for pages with more than a single reference */
+    if(!(pg->pg_flags & PG_MOVABLE) || !pg->pg_owner || (pg->pg_refcount != 1))
+        return EBUSY;
+
+    if((target = pmm_alloc()) == 0)
+        return ENOMEM;
+
+    /* FIXME: this is only safe as long as nothing else
+     * can write to the page between the copy and the remap;
+     * with SMP the mapping has to be made read-only first */
+    memcpy(phys_to_hhdm(target), phys_to_hhdm(address), PAGE_SIZE);
+
+    if((r = vmm_remap(pg->pg_owner, pg->pg_index, target)) != 0) {
+        pmm_free(target);
+        return r;
+    }
+
+    target_pg = phys_to_page(target);
+    target_pg->pg_flags = pg->pg_flags;
+    target_pg->pg_private = pg->pg_private;
+    target_pg->pg_owner = pg->pg_owner;
+    target_pg->pg_index = pg->pg_index;
+
+    pg->pg_flags = 0;
+    pg->pg_refcount = 0;
+    pg->pg_private = 0;
+    pg->pg_owner = NULL;
+    pg->pg_index = 0;
+
+    return 0;
+}
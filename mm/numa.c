@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <acpi/slit.h>
+#include <arch/cpuid.h>
+#include <kern/printf.h>
+#include <mm/numa.h>
+#include <vex/errno.h>
+
+struct numa_cpu {
+    uint32_t nc_apic_id;
+    unsigned int nc_node;
+};
+
+unsigned int numa_num_nodes = 0;
+unsigned int numa_fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+static uint32_t domains[MAX_NUMA_NODES];
+static unsigned char distances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+static size_t num_memranges = 0;
+static struct numa_memrange memranges[MAX_NUMA_MEMRANGES];
+
+static size_t num_cpus = 0;
+static struct numa_cpu cpus[MAX_CPUS];
+static unsigned int cpu_nodes[MAX_CPUS] = { 0 };
+
+static int lookup_domain(uint32_t domain, unsigned int *restrict node)
+{
+    unsigned int i;
+
+    for(i = 0; i < numa_num_nodes; ++i) {
+        if(domains[i] != domain)
+            continue;
+        node[0] = i;
+        return 0;
+    }
+
+    return ENOENT;
+}
+
+static int get_domain(uint32_t domain, unsigned int *restrict node)
+{
+    if(!lookup_domain(domain, node))
+        return 0;
+
+    if(numa_num_nodes >= MAX_NUMA_NODES) {
+        kprintf(KP_WARNING, "numa: too many proximity domains [%u]", (unsigned int)domain);
+        return ENOMEM;
+    }
+
+    domains[numa_num_nodes] = domain;
+    node[0] = numa_num_nodes++;
+    return 0;
+}
+
+int numa_add_cpu(uint32_t domain, uint32_t apic_id)
+{
+    int r;
+    unsigned int node;
+
+    if((r = get_domain(domain, &node)) != 0)
+        return r;
+
+    if(num_cpus >= MAX_CPUS)
+        return ENOMEM;
+
+    cpus[num_cpus].nc_apic_id = apic_id;
+    cpus[num_cpus].nc_node = node;
+    num_cpus += 1;
+
+    return 0;
+}
+
+int numa_add_memrange(uint32_t domain, uintptr_t base, uintptr_t length)
+{
+    int r;
+    size_t i;
+    unsigned int node;
+
+    if(length == 0)
+        return EINVAL;
+
+    if((r = get_domain(domain, &node)) != 0)
+        return r;
+
+    if(num_memranges >= MAX_NUMA_MEMRANGES) {
+        kprintf(KP_WARNING, "numa: too many memory ranges");
+        return ENOMEM;
+    }
+
+    /* Keep the ranges sorted by base address */
+    for(i = num_memranges; i > 0; --i) {
+        if(memranges[i - 1].nm_base < base)
+            break;
+        memranges[i] = memranges[i - 1];
+    }
+
+    memranges[i].nm_base = base;
+    memranges[i].nm_end = base + length;
+    memranges[i].nm_node = node;
+    num_memranges += 1;
+
+    return 0;
+}
+
+void numa_set_distance(uint32_t domain_a, uint32_t domain_b, unsigned int distance)
+{
+    unsigned int node_a;
+    unsigned int node_b;
+
+    if(lookup_domain(domain_a, &node_a) || lookup_domain(domain_b, &node_b))
+        return;
+    distances[node_a][node_b] = distance;
+}
+
+unsigned int numa_distance(unsigned int node_a, unsigned int node_b)
+{
+    return distances[node_a][node_b];
+}
+
+unsigned int numa_cpu_node(unsigned int cpu)
+{
+    return cpu_nodes[cpu];
+}
+
+unsigned int numa_addr_to_node(uintptr_t address, uintptr_t *restrict limit)
+{
+    size_t i;
+
+    for(i = 0; i < num_memranges; ++i) {
+        if(address >= memranges[i].nm_end)
+            continue;
+
+        if(address < memranges[i].nm_base) {
+            if(limit)
+                limit[0] = memranges[i].nm_base;
+            return 0;
+        }
+
+        if(limit)
+            limit[0] = memranges[i].nm_end;
+        return memranges[i].nm_node;
+    }
+
+    if(limit)
+        limit[0] = UINTPTR_MAX;
+    return 0;
+}
+
+void init_numa(void)
+{
+    size_t i;
+    uint32_t apic_id;
+    unsigned int a, b, c;
+    unsigned int tmp;
+
+    if(numa_num_nodes == 0) {
+        /* No SRAT, or an empty one; everything
+         * then belongs to a single node */
+        numa_num_nodes = 1;
+        domains[0] = 0;
+    }
+
+    for(a = 0; a < numa_num_nodes; ++a) {
+        for(b = 0; b < numa_num_nodes; ++b) {
+            if(slit && distances[a][b])
+                continue;
+            distances[a][b] = (a == b) ? SLIT_LOCAL_DISTANCE : SLIT_REMOTE_DISTANCE;
+        }
+    }
+
+    /* Each node falls back to the others in
+     * order of increasing distance; the node itself
+     * always comes first as it is the nearest one */
+    for(a = 0; a < numa_num_nodes; ++a) {
+        for(b = 0; b < numa_num_nodes; ++b) {
+            tmp = (a + b) % numa_num_nodes;
+            for(c = b; (c > 0) && (distances[a][numa_fallback[a][c - 1]] > distances[a][tmp]); --c)
+                numa_fallback[a][c] = numa_fallback[a][c - 1];
+            numa_fallback[a][c] = tmp;
+        }
+    }
+
+    apic_id = cpuid_apic_id();
+
+    for(i = 0; i < num_cpus; ++i) {
+        if(cpus[i].nc_apic_id != apic_id)
+            continue;
+        cpu_nodes[0] = cpus[i].nc_node;
+        break;
+    }
+
+    for(i = 0; i < num_memranges; ++i) {
+        kprintf(KP_INFORM, "numa: node %u: [%p-%p]", memranges[i].nm_node,
+            (void *)memranges[i].nm_base, (void *)(memranges[i].nm_end - 1));
+    }
+
+    kprintf(KP_INFORM, "numa: %u nodes, BSP is on node %u", numa_num_nodes, cpu_nodes[0]);
+}
@@ -1,42 +1,656 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
+#include <arch/ntstore.h>
 #include <bitmap.h>
+#include <iecprefix.h>
 #include <kern/assert.h>
 #include <kern/panic.h>
 #include <kern/printf.h>
+#include <kern/smp.h>
+#include <mm/cma.h>
 #include <mm/hhdm.h>
-#include <mm/memmap.h>
+#include <mm/memblock.h>
+#include <mm/migrate.h>
+#include <mm/numa.h>
 #include <mm/page.h>
 #include <mm/pmm.h>
 #include <string.h>
 #include <strings.h>
+#include <vex/errno.h>
 
-static void **page_list = NULL;
+struct buddy_block {
+    struct buddy_block *bb_next;
+    struct buddy_block *bb_prev;
+};
+
+/* Free memory that has not been handed over to the
+ * buddy allocator yet is kept as extents; pages are carved
+ * out of them lazily once the free lists run dry, so that
+ * initialization never has to touch every page of RAM */
+struct pmm_extent {
+    struct pmm_extent *ex_next;
+    size_t ex_page;
+    size_t ex_endpage;
+};
+
+struct zone {
+    struct buddy_block *zn_lists[PMM_MAX_ORDER + 1];
+    struct pmm_extent *zn_extents;
+    size_t zn_extent_pages;
+    size_t zn_free_pages;
+    size_t zn_present_pages;
+    unsigned int zn_node;
+    unsigned int zn_type;
+};
+
+static struct zone zones[MAX_NUMA_NODES][MAX_ZONES];
+static const char *zone_names[MAX_ZONES] = { "DMA", "DMA32", "Normal" };
+
+static size_t num_extents = 0;
+static struct pmm_extent extents[PMM_MAX_EXTENTS];
+
+struct page *page_array = NULL;
+size_t page_array_count = 0;
+
+/* The page metadata array is initialized one section
+ * (a maximum order block worth of pages) at a time when
+ * the first block in the section is carved; buddies always
+ * share a section, so uninitialized entries are never read */
+static bitmap_t *sections = NULL;
+
+/* Per-CPU page cache is a ring of page addresses;
+ * the hot end is where recently freed (and thus likely
+ * cache-warm) pages go, the cold end is the one that
+ * gets drained back into the buddy allocator first.
+ * Pre-zeroed pages are kept on a separate list that is
+ * linked through the first word of each page */
+struct pmm_pcp {
+    size_t pc_tail;
+    size_t pc_count;
+    size_t pc_nzeroed;
+    void **pc_zeroed;
+    uintptr_t pc_pages[PMM_PCP_SIZE];
+} __aligned(CACHELINE_SIZE);
+
+static struct pmm_pcp pcps[MAX_CPUS] = { 0 };
+
+static struct pmm_shrinker *shrinkers = NULL;
+
+static size_t compact_cursor = 0;
+static struct pmm_compact_stats compact_stats = { 0 };
+
+static struct zone *dma_zone = NULL;
 static uintptr_t dma_end_addr = 0;
 static bitmap_t *dma_bitmap = NULL;
 static size_t dma_numpages = 0;
 static size_t dma_lastpage = 0;
 
-uintptr_t dma_alloc(size_t npages)
+static __always_inline __nodiscard inline unsigned int addr_node(uintptr_t address)
+{
+    return numa_addr_to_node(address, NULL);
+}
+
+static __always_inline __nodiscard inline struct zone *addr_zone(uintptr_t address)
+{
+    if(address <= ZONE_DMA32_END)
+        return &zones[addr_node(address)][ZONE_DMA32];
+    return &zones[addr_node(address)][ZONE_NORMAL];
+}
+
+static __always_inline __nodiscard inline int buddy_isfree(struct zone *restrict zone, size_t page, unsigned int order)
+{
+    const struct page *pg;
+
+    if(page >= page_array_count)
+        return 0;
+    pg = &page_array[page];
+
+    /* Blocks are never merged across
+     * zone (and thus node) boundaries */
+    if(!(pg->pg_flags & PG_BUDDY) || (pg->pg_order != order))
+        return 0;
+    return (pg->pg_node == zone->zn_node) && (pg->pg_zone == zone->zn_type);
+}
+
+static void buddy_insert(struct zone *restrict zone, size_t page, unsigned int order)
+{
+    struct page *pg = &page_array[page];
+    struct buddy_block *block = phys_to_hhdm(page * PAGE_SIZE);
+
+    block->bb_next = zone->zn_lists[order];
+    block->bb_prev = NULL;
+
+    pg->pg_flags = PG_BUDDY;
+    pg->pg_order = order;
+    pg->pg_node = zone->zn_node;
+    pg->pg_zone = zone->zn_type;
+
+    if(zone->zn_lists[order])
+        zone->zn_lists[order]->bb_prev = block;
+    zone->zn_lists[order] = block;
+
+    zone->zn_free_pages += (UINT64_C(1) << order);
+}
+
+static void buddy_remove(struct zone *restrict zone, size_t page, unsigned int order)
+{
+    struct buddy_block *block = phys_to_hhdm(page * PAGE_SIZE);
+
+    if(block->bb_prev)
+        block->bb_prev->bb_next = block->bb_next;
+    else zone->zn_lists[order] = block->bb_next;
+
+    if(block->bb_next)
+        block->bb_next->bb_prev = block->bb_prev;
+
+    page_array[page].pg_flags &= ~PG_BUDDY;
+    zone->zn_free_pages -= (UINT64_C(1) << order);
+}
+
+static int zone_carve(struct zone *restrict zone, unsigned int order);
+
+static uintptr_t buddy_alloc(struct zone *restrict zone, unsigned int order)
 {
     size_t page;
-    size_t maxpage;
+    unsigned int i;
+
+    if((zone->zn_free_pages + zone->zn_extent_pages) < (UINT64_C(1) << order))
+        return 0;
+
+    do {
+        for(i = order; i <= PMM_MAX_ORDER; ++i) {
+            if(!zone->zn_lists[i])
+                continue;
+
+            page = hhdm_to_phys(zone->zn_lists[i]) / PAGE_SIZE;
+            buddy_remove(zone, page, i);
+
+            /* Split the block in halves and give the
+             * upper halves back until it fits the request */
+            while(i > order) {
+                i -= 1;
+                buddy_insert(zone, page + (UINT64_C(1) << i), i);
+            }
 
-    maxpage = dma_numpages - npages;
-    for(page = dma_lastpage; page < maxpage; ++page) {
-        if(bitmap_range_isset(dma_bitmap, page, page + npages - 1)) {
-            bitmap_range_clear(dma_bitmap, page, page + npages - 1);
-            dma_lastpage = page + npages;
             return page * PAGE_SIZE;
         }
+    } while(zone_carve(zone, order));
+
+    return 0;
+}
+
+/* Returns the order of the block that ended
+ * up on the free lists after merging buddies */
+static unsigned int buddy_free(struct zone *restrict zone, size_t page, unsigned int order)
+{
+    size_t buddy;
+
+    while(order < PMM_MAX_ORDER) {
+        buddy = page ^ (UINT64_C(1) << order);
+
+        if(!buddy_isfree(zone, buddy, order))
+            break;
+        buddy_remove(zone, buddy, order);
+
+        page &= ~(UINT64_C(1) << order);
+        order += 1;
     }
 
-    maxpage = dma_lastpage - npages;
-    for(page = 0; page < maxpage; ++page) {
-        if(bitmap_range_isset(dma_bitmap, page, page + npages - 1)) {
+    buddy_insert(zone, page, order);
+
+    return order;
+}
+
+static void init_section(size_t page)
+{
+    size_t section = page >> PMM_MAX_ORDER;
+    size_t first, count;
+
+    if(bitmap_isset(sections, section))
+        return;
+
+    first = section << PMM_MAX_ORDER;
+    count = UINT64_C(1) << PMM_MAX_ORDER;
+
+    if((first + count) > page_array_count)
+        count = page_array_count - first;
+
+    memset(&page_array[first], 0, count * sizeof(struct page));
+    bitmap_set(sections, section);
+}
+
+static size_t seed_block(struct zone *restrict zone, size_t page, size_t endpage, unsigned int *restrict merged)
+{
+    unsigned int order;
+
+    /* Carve the largest block that
+     * is both naturally aligned and fits */
+    for(order = PMM_MAX_ORDER; order > 0; --order) {
+        if(page & ((UINT64_C(1) << order) - 1))
+            continue;
+        if((page + (UINT64_C(1) << order)) > endpage)
+            continue;
+        break;
+    }
+
+    init_section(page);
+    merged[0] = buddy_free(zone, page, order);
+
+    return UINT64_C(1) << order;
+}
+
+static int zone_carve(struct zone *restrict zone, unsigned int order)
+{
+    size_t npages;
+    unsigned int merged;
+    struct pmm_extent *extent;
+
+    /* Blocks carved from the start of an extent get
+     * larger as the alignment improves and may merge with
+     * free buddies; keep going until a block of at least
+     * the requested order shows up on the free lists */
+    while((extent = zone->zn_extents) != NULL) {
+        npages = seed_block(zone, extent->ex_page, extent->ex_endpage, &merged);
+
+        extent->ex_page += npages;
+        zone->zn_extent_pages -= npages;
+
+        if(extent->ex_page >= extent->ex_endpage)
+            zone->zn_extents = extent->ex_next;
+
+        if(merged >= order)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void zone_add_extent(struct zone *restrict zone, size_t page, size_t endpage)
+{
+    unsigned int merged;
+    struct pmm_extent *extent;
+
+    zone->zn_present_pages += endpage - page;
+
+    if(num_extents >= PMM_MAX_EXTENTS) {
+        /* Out of extent slots; there is no other
+         * choice than to seed the range right away */
+        while(page < endpage)
+            page += seed_block(zone, page, endpage, &merged);
+        return;
+    }
+
+    extent = &extents[num_extents++];
+    extent->ex_next = zone->zn_extents;
+    extent->ex_page = page;
+    extent->ex_endpage = endpage;
+
+    zone->zn_extents = extent;
+    zone->zn_extent_pages += endpage - page;
+}
+
+static size_t buddy_seed(uintptr_t start, uintptr_t end)
+{
+    size_t page, endpage;
+    size_t zone_endpage;
+    size_t count = 0;
+    uintptr_t limit;
+    struct zone *zone;
+
+    page = page_align_up(start) / PAGE_SIZE;
+    endpage = page_align(end) / PAGE_SIZE;
+
+    while(page < endpage) {
+        /* Figure out how far the zone the
+         * current page belongs to stretches */
+        zone = &zones[numa_addr_to_node(page * PAGE_SIZE, &limit)][ZONE_NORMAL];
+
+        if((page * PAGE_SIZE) <= ZONE_DMA32_END) {
+            zone = &zones[zone->zn_node][ZONE_DMA32];
+            if(limit > (ZONE_DMA32_END + 1))
+                limit = ZONE_DMA32_END + 1;
+        }
+
+        zone_endpage = limit / PAGE_SIZE;
+        if(zone_endpage > endpage)
+            zone_endpage = endpage;
+        if(zone_endpage <= page)
+            zone_endpage = page + 1;
+
+        zone_add_extent(zone, page, zone_endpage);
+        count += zone_endpage - page;
+        page = zone_endpage;
+    }
+
+    return count;
+}
+
+static int compact_block(size_t page)
+{
+    int r;
+    size_t i;
+    size_t endpage;
+    size_t nmovable;
+    unsigned int order;
+    struct page *pg;
+    struct zone *zone;
+
+    endpage = page + PMM_HUGE_PAGES;
+
+    if((endpage > page_array_count) || !bitmap_isset(sections, page >> PMM_MAX_ORDER))
+        return 0;
+
+    /* Anything up to dma_end_addr belongs to the DMA
+     * bitmap and must never end up on the buddy lists */
+    if((page * PAGE_SIZE) <= dma_end_addr)
+        return 0;
+
+    /* CMA pages are accounted for by the CMA bitmap
+     * and have to stay out of the buddy lists as well */
+    if(cma_contains(page * PAGE_SIZE) || cma_contains((endpage - 1) * PAGE_SIZE))
+        return 0;
+
+    zone = addr_zone(page * PAGE_SIZE);
+    if(zone != addr_zone((endpage - 1) * PAGE_SIZE))
+        return 0;
+
+    /* Don't bother with blocks that are already
+     * free or hold anything that cannot be moved */
+    nmovable = 0;
+    for(i = page; i < endpage; i += UINT64_C(1) << order) {
+        pg = &page_array[i];
+        order = 0;
+
+        if(pg->pg_flags & PG_BUDDY) {
+            if(pg->pg_order >= PMM_HUGE_ORDER)
+                return 0;
+            order = pg->pg_order;
+            continue;
+        }
+
+        if(!(pg->pg_flags & PG_MOVABLE) || !pg->pg_owner || (pg->pg_refcount != 1))
+            return 0;
+        nmovable += 1;
+    }
+
+    if(!nmovable)
+        return 0;
+    compact_stats.cs_blocks_scanned += 1;
+
+    /* Take the free parts off the free lists
+     * so that migration does not land in there */
+    for(i = page; i < endpage; i += UINT64_C(1) << order) {
+        pg = &page_array[i];
+        order = 0;
+
+        if(pg->pg_flags & PG_BUDDY) {
+            order = pg->pg_order;
+            buddy_remove(zone, i, order);
+            pg->pg_flags |= PG_ISOLATED;
+        }
+    }
+
+    r = 0;
+    for(i = page; i < endpage; ++i) {
+        pg = &page_array[i];
+
+        if(pg->pg_flags & PG_ISOLATED) {
+            i += (UINT64_C(1) << pg->pg_order) - 1;
+            continue;
+        }
+
+        if((r = migrate_page(i * PAGE_SIZE)) != 0)
+            break;
+
+        pg->pg_flags = PG_ISOLATED;
+        pg->pg_order = 0;
+        compact_stats.cs_pages_moved += 1;
+    }
+
+    /* Whatever has been isolated goes back
+     * and coalesces if everything went right */
+    for(i = page; i < endpage; i += UINT64_C(1) << order) {
+        pg = &page_array[i];
+        order = 0;
+
+        if(pg->pg_flags & PG_ISOLATED) {
+            order = pg->pg_order;
+            pg->pg_flags &= ~PG_ISOLATED;
+            buddy_free(zone, i, order);
+        }
+    }
+
+    if(r != 0) {
+        compact_stats.cs_failures += 1;
+        return 0;
+    }
+
+    compact_stats.cs_blocks_recovered += 1;
+    return 1;
+}
+
+static size_t compact(unsigned int node, size_t budget, size_t max_blocks)
+{
+    size_t page;
+    size_t nblocks;
+    size_t recovered;
+
+    nblocks = page_array_count / PMM_HUGE_PAGES;
+    recovered = 0;
+
+    if(!nblocks)
+        return 0;
+
+    /* Pages sitting in the cache look
+     * just like the allocated ones do */
+    pmm_drain_local();
+
+    while(budget-- && (recovered < max_blocks)) {
+        page = (compact_cursor++ % nblocks) * PMM_HUGE_PAGES;
+
+        if((node < numa_num_nodes) && (addr_node(page * PAGE_SIZE) != node))
+            continue;
+        recovered += compact_block(page);
+    }
+
+    return recovered;
+}
+
+static size_t shrink(void)
+{
+    size_t count = 0;
+    struct pmm_shrinker *shrinker;
+
+    for(shrinker = shrinkers; shrinker; shrinker = shrinker->sh_next)
+        count += shrinker->sh_func();
+    return count;
+}
+
+static uintptr_t nodes_alloc(unsigned int node, unsigned int order, unsigned int flags)
+{
+    unsigned int i;
+    unsigned int count;
+    unsigned int fallback;
+    uintptr_t address;
+
+    count = (flags & PMM_THISNODE) ? 1 : numa_num_nodes;
+
+    for(i = 0; i < count; ++i) {
+        fallback = numa_fallback[node][i];
+
+        if(!(flags & PMM_DMA32)) {
+            if((address = buddy_alloc(&zones[fallback][ZONE_NORMAL], order)) != 0)
+                return address;
+        }
+
+        if((address = buddy_alloc(&zones[fallback][ZONE_DMA32], order)) != 0)
+            return address;
+    }
+
+    return 0;
+}
+
+static __always_inline inline void pcp_push_hot(struct pmm_pcp *restrict pcp, uintptr_t address)
+{
+    pcp->pc_pages[(pcp->pc_tail + pcp->pc_count) % PMM_PCP_SIZE] = address;
+    pcp->pc_count += 1;
+}
+
+static __always_inline inline void pcp_push_cold(struct pmm_pcp *restrict pcp, uintptr_t address)
+{
+    pcp->pc_tail = (pcp->pc_tail + PMM_PCP_SIZE - 1) % PMM_PCP_SIZE;
+    pcp->pc_pages[pcp->pc_tail] = address;
+    pcp->pc_count += 1;
+}
+
+static __always_inline __nodiscard inline uintptr_t pcp_pop_hot(struct pmm_pcp *restrict pcp)
+{
+    pcp->pc_count -= 1;
+    return pcp->pc_pages[(pcp->pc_tail + pcp->pc_count) % PMM_PCP_SIZE];
+}
+
+static __always_inline __nodiscard inline uintptr_t pcp_pop_cold(struct pmm_pcp *restrict pcp)
+{
+    uintptr_t address = pcp->pc_pages[pcp->pc_tail];
+    pcp->pc_tail = (pcp->pc_tail + 1) % PMM_PCP_SIZE;
+    pcp->pc_count -= 1;
+    return address;
+}
+
+static int pcp_refill(struct pmm_pcp *restrict pcp, unsigned int node)
+{
+    size_t i;
+    uintptr_t address;
+
+    /* Grabbing a whole batch-sized block costs a
+     * single trip to the buddy allocator; only fall back
+     * to taking pages one by one when it is fragmented.
+     * Per-CPU caches only ever hold node-local pages. */
+    if((address = nodes_alloc(node, PMM_PCP_ORDER, PMM_THISNODE)) != 0) {
+        for(i = PMM_PCP_BATCH; i > 0; --i)
+            pcp_push_hot(pcp, address + (i - 1) * PAGE_SIZE);
+        return 1;
+    }
+
+    for(i = 0; i < PMM_PCP_BATCH; ++i) {
+        if((address = nodes_alloc(node, 0, PMM_THISNODE)) == 0)
+            break;
+        pcp_push_hot(pcp, address);
+    }
+
+    return pcp->pc_count != 0;
+}
+
+static void pcp_drain(struct pmm_pcp *restrict pcp, size_t count)
+{
+    uintptr_t address;
+
+    while(count-- && pcp->pc_count) {
+        address = pcp_pop_cold(pcp);
+        buddy_free(addr_zone(address), address / PAGE_SIZE, 0);
+    }
+}
+
+static void pcp_drain_zeroed(struct pmm_pcp *restrict pcp)
+{
+    void **headptr;
+    uintptr_t address;
+
+    while((headptr = pcp->pc_zeroed) != NULL) {
+        pcp->pc_zeroed = headptr[0];
+        pcp->pc_nzeroed -= 1;
+
+        /* The pool may have been topped up from
+         * the bitmap allocator when buddy ran dry */
+        address = hhdm_to_phys(headptr);
+        if(address < dma_end_addr) {
+            dma_free(address, 1);
+            continue;
+        }
+
+        buddy_free(addr_zone(address), address / PAGE_SIZE, 0);
+    }
+}
+
+uintptr_t dma_alloc(size_t npages)
+{
+    size_t page;
+    size_t limit;
+
+    if((npages == 0) || (npages > dma_numpages))
+        return 0;
+
+    page = bitmap_find_run(dma_bitmap, dma_numpages, dma_lastpage, npages);
+
+    if(page >= dma_numpages) {
+        /* Wrap around; runs that begin before the
+         * last allocation and extend past it still count */
+        limit = dma_lastpage + npages - 1;
+        if(limit > dma_numpages)
+            limit = dma_numpages;
+        page = bitmap_find_run(dma_bitmap, limit, 0, npages);
+        if(page >= limit)
+            return 0;
+    }
+
+    bitmap_range_clear(dma_bitmap, page, page + npages - 1);
+    dma_zone->zn_free_pages -= npages;
+    dma_lastpage = page + npages;
+    return page * PAGE_SIZE;
+}
+
+uintptr_t dma_alloc_constrained(size_t npages, size_t align, size_t boundary, uintptr_t max_phys)
+{
+    size_t page;
+    size_t limit;
+    size_t end;
+    size_t align_pages;
+    size_t boundary_pages;
+
+    kassert(!(align & (align - 1)));
+    kassert(!(boundary & (boundary - 1)));
+
+    align_pages = (align > PAGE_SIZE) ? (align / PAGE_SIZE) : 1;
+    boundary_pages = boundary / PAGE_SIZE;
+
+    if((npages == 0) || (boundary && (npages > boundary_pages)))
+        return 0;
+
+    limit = dma_numpages;
+
+    if(max_phys) {
+        /* Same as (max_phys + 1) / PAGE_SIZE except it
+         * doesn't wrap around to zero for UINTPTR_MAX */
+        end = (max_phys / PAGE_SIZE) + ((max_phys % PAGE_SIZE) == (PAGE_SIZE - 1));
+        if(end < limit)
+            limit = end;
+    }
+
+    page = 0;
+
+    while(page < limit) {
+        if((page = bitmap_find_set(dma_bitmap, limit, page)) >= limit)
+            break;
+        page = align_ceil(page, align_pages);
+
+        /* A run that would straddle the boundary
+         * can only ever start at the boundary itself */
+        if(boundary_pages && ((page / boundary_pages) != ((page + npages - 1) / boundary_pages))) {
+            page = align_ceil(page + 1, boundary_pages);
+            continue;
+        }
+
+        if((page + npages) > limit)
+            break;
+
+        /* Any clear bit inside the candidate run
+         * is where the next candidate search resumes */
+        if((end = bitmap_find_clear(dma_bitmap, page + npages, page)) >= (page + npages)) {
             bitmap_range_clear(dma_bitmap, page, page + npages - 1);
-            dma_lastpage = page + npages;
+            dma_zone->zn_free_pages -= npages;
             return page * PAGE_SIZE;
         }
+
+        page = end;
     }
 
     return 0;
@@ -50,15 +664,24 @@ void *dma_alloc_hhdm(size_t npages)
     return NULL;
 }
 
+void *dma_alloc_constrained_hhdm(size_t npages, size_t align, size_t boundary, uintptr_t max_phys)
+{
+    uintptr_t address;
+    if((address = dma_alloc_constrained(npages, align, boundary, max_phys)) != 0)
+        return phys_to_hhdm(address);
+    return NULL;
+}
+
 void dma_free(uintptr_t address, size_t npages)
 {
     size_t page = address / PAGE_SIZE;
 
     kassert((address) < dma_end_addr);
-    kassert((page + npages) < dma_numpages);
+    kassert((page + npages) <= dma_numpages);
 
     if(address != 0) {
         bitmap_range_set(dma_bitmap, page, page + npages - 1);
+        dma_zone->zn_free_pages += npages;
         dma_lastpage = page;
     }
 }
@@ -70,20 +693,152 @@ void dma_free_hhdm(void *restrict ptr, size_t npages)
     dma_free(hhdm_to_phys(ptr), npages);
 }
 
-uintptr_t pmm_alloc(void)
+static uintptr_t alloc_node(unsigned int node, unsigned int order, unsigned int flags)
 {
     uintptr_t address;
+    struct pmm_pcp *pcp;
+
+    kassert(order <= PMM_MAX_ORDER);
+    kassert(node < numa_num_nodes);
 
-    if(page_list) {
-        address = hhdm_to_phys(page_list);
-        page_list = page_list[0];
+    if((order == 0) && !(flags & PMM_DMA32) && (node == numa_local_node())) {
+        pcp = &pcps[smp_cpu_index()];
+        if(pcp->pc_count || pcp_refill(pcp, node))
+            return pcp_pop_hot(pcp);
+    }
+
+    if((address = nodes_alloc(node, order, flags)) != 0)
         return address;
+
+    if((order != 0) || pcps[smp_cpu_index()].pc_nzeroed) {
+        /* Pages sitting in the cache may be the missing
+         * halves of a larger free block, and pre-zeroed
+         * ones are of no use to anyone while we're short */
+        pmm_drain_local();
+
+        if((address = nodes_alloc(node, order, flags)) != 0)
+            return address;
     }
 
-    /* Fall back to the bitmap allocator in case the linked
-     * list allocator runs out or if there was not enough
+    if(shrink()) {
+        pmm_drain_local();
+
+        if((address = nodes_alloc(node, order, flags)) != 0) {
+            return address;
+        }
+    }
+
+    if(order >= PMM_HUGE_ORDER) {
+        /* Try to piece a huge page back together out
+         * of fragmented memory; this goes through every
+         * block of the node once in the worst case */
+        if(compact(node, page_array_count / PMM_HUGE_PAGES, 1)) {
+            if((address = nodes_alloc(node, order, flags)) != 0) {
+                return address;
+            }
+        }
+    }
+
+    /* Fall back to the bitmap allocator in case the buddy
+     * allocator runs out or if there was not enough
      * memory to initialize it in the first place */
-    return dma_alloc(1);
+    if((flags & PMM_THISNODE) && (node != addr_node(0)))
+        return 0;
+    if(order == 0)
+        return dma_alloc(1);
+    return dma_alloc_constrained(UINT64_C(1) << order, PAGE_SIZE << order, 0, 0);
+}
+
+static void prep_page(uintptr_t address, unsigned int order)
+{
+    struct page *pg = phys_to_page(address);
+
+    pg->pg_flags = 0;
+    pg->pg_refcount = 1;
+    pg->pg_order = order;
+    pg->pg_owner = NULL;
+    pg->pg_index = 0;
+}
+
+/* Drops whatever the last owner left in the struct
+ * page; returns nonzero if the page went back to CMA
+ * and there is nothing left for the caller to do */
+static int release_page(uintptr_t address, unsigned int order)
+{
+    struct page *pg = phys_to_page(address);
+
+    pg->pg_flags = 0;
+    pg->pg_refcount = 0;
+    pg->pg_order = order;
+    pg->pg_owner = NULL;
+
+    if(cma_contains(address)) {
+        kassert(order == 0);
+        cma_free_page(address);
+        return 1;
+    }
+
+    return 0;
+}
+
+uintptr_t pmm_alloc_node(unsigned int node, unsigned int order, unsigned int flags)
+{
+    uintptr_t address;
+    if((address = alloc_node(node, order, flags)) != 0)
+        prep_page(address, order);
+    return address;
+}
+
+uintptr_t pmm_alloc_order(unsigned int order)
+{
+    return pmm_alloc_node(numa_local_node(), order, 0);
+}
+
+void *pmm_alloc_order_hhdm(unsigned int order)
+{
+    uintptr_t address;
+    if((address = pmm_alloc_order(order)) != 0)
+        return phys_to_hhdm(address);
+    return NULL;
+}
+
+void pmm_free_order(uintptr_t address, unsigned int order)
+{
+    struct pmm_pcp *pcp;
+
+    kassert(order <= PMM_MAX_ORDER);
+
+    if(release_page(address, order))
+        return;
+
+    if(address >= dma_end_addr) {
+        kassert(!(address & ((PAGE_SIZE << order) - 1)));
+
+        if((order == 0) && (addr_node(address) == numa_local_node())) {
+            pcp = &pcps[smp_cpu_index()];
+            if(pcp->pc_count >= PMM_PCP_SIZE)
+                pcp_drain(pcp, PMM_PCP_BATCH);
+            pcp_push_hot(pcp, address);
+            return;
+        }
+
+        buddy_free(addr_zone(address), address / PAGE_SIZE, order);
+        return;
+    }
+
+    dma_free(address, UINT64_C(1) << order);
+}
+
+void pmm_free_order_hhdm(void *restrict ptr, unsigned int order)
+{
+    if(ptr == NULL)
+        return;
+    pmm_free_order(hhdm_to_phys(ptr), order);
+}
+
+uintptr_t pmm_alloc(void)
+{
+    return pmm_alloc_order(0);
 }
 
 void *pmm_alloc_hhdm(void)
@@ -96,114 +851,309 @@ void *pmm_alloc_hhdm(void)
 
 void pmm_free(uintptr_t address)
 {
-    void **headptr;
+    pmm_free_order(address, 0);
+}
+
+void pmm_free_hhdm(void *restrict ptr)
+{
+    if(ptr == NULL)
+        return;
+    pmm_free(hhdm_to_phys(ptr));
+}
+
+void pmm_free_cold(uintptr_t address)
+{
+    struct pmm_pcp *pcp;
+
+    if(release_page(address, 0))
+        return;
 
     if(address >= dma_end_addr) {
-        headptr = phys_to_hhdm(address);
-        headptr[0] = page_list;
-        page_list = headptr;
+        if(addr_node(address) == numa_local_node()) {
+            pcp = &pcps[smp_cpu_index()];
+            if(pcp->pc_count >= PMM_PCP_SIZE)
+                pcp_drain(pcp, PMM_PCP_BATCH);
+            pcp_push_cold(pcp, address);
+            return;
+        }
+
+        buddy_free(addr_zone(address), address / PAGE_SIZE, 0);
         return;
     }
 
     dma_free(address, 1);
 }
 
-void pmm_free_hhdm(void *restrict ptr)
+void pmm_drain_local(void)
 {
-    if(ptr == NULL)
+    struct pmm_pcp *pcp = &pcps[smp_cpu_index()];
+    pcp_drain(pcp, pcp->pc_count);
+    pcp_drain_zeroed(pcp);
+}
+
+uintptr_t pmm_alloc_movable(void)
+{
+    uintptr_t address;
+
+    /* Movable pages go to the CMA region first, so that
+     * it is not sitting idle until someone needs it */
+    if((address = cma_alloc_page()) != 0)
+        prep_page(address, 0);
+    else if((address = pmm_alloc()) == 0)
+        return 0;
+
+    phys_to_page(address)->pg_flags |= PG_MOVABLE;
+    return address;
+}
+
+int pmm_page_initialized(uintptr_t address)
+{
+    size_t page = address / PAGE_SIZE;
+
+    if((sections == NULL) || (page >= page_array_count))
+        return 0;
+    return bitmap_isset(sections, page >> PMM_MAX_ORDER);
+}
+
+void pmm_page_get(uintptr_t address)
+{
+    phys_to_page(address)->pg_refcount += 1;
+}
+
+void pmm_page_put(uintptr_t address)
+{
+    struct page *pg = phys_to_page(address);
+
+    kassert(pg->pg_refcount != 0);
+
+    if(--pg->pg_refcount == 0) {
+        pmm_free_order(address, pg->pg_order);
         return;
-    pmm_free(hhdm_to_phys(ptr));
+    }
 }
 
-void init_pmm(void)
+int pmm_get_stats(unsigned int node, unsigned int type, struct pmm_stats *restrict stats)
+{
+    const struct zone *zone;
+
+    if((node >= numa_num_nodes) || (type >= MAX_ZONES))
+        return EINVAL;
+    zone = &zones[node][type];
+
+    stats->ps_present = zone->zn_present_pages;
+    stats->ps_free = zone->zn_free_pages + zone->zn_extent_pages;
+    return 0;
+}
+
+size_t pmm_cached_pages(void)
 {
     size_t i;
-    size_t page, npages;
-    size_t bitmap_size;
-    size_t list_numpages;
-    uintptr_t address;
-    uintptr_t bitmap_phys;
-    void **head_ptr;
-    struct limine_memmap_entry *entry;
+    size_t count = 0;
 
-    /* Determine the actual end of the DMA space */
-    for(i = 0; i < memmap.response->entry_count; ++i) {
-        entry = memmap.response->entries[i];
+    for(i = 0; i < MAX_CPUS; ++i)
+        count += pcps[i].pc_count + pcps[i].pc_nzeroed;
+    return count;
+}
 
-        if((entry->type == LIMINE_MEMMAP_USABLE) && (entry->base <= DMA_APPROX_END)) {
-            address = entry->base + entry->length - 1;
+void pmm_print_stats(void)
+{
+    unsigned int node, type;
+    struct pmm_stats stats;
+    size_t total_present = 0;
+    size_t total_free = 0;
 
-            if(dma_end_addr >= address)
+    for(node = 0; node < numa_num_nodes; ++node) {
+        for(type = 0; type < MAX_ZONES; ++type) {
+            if(pmm_get_stats(node, type, &stats) || !stats.ps_present)
                 continue;
-            dma_end_addr = address;
+
+            kprintf(KP_INFORM, "pmm: node %u, zone %s: %zu KiB free, %zu KiB used", node, zone_names[type],
+                (stats.ps_free * PAGE_SIZE) >> KIBI, ((stats.ps_present - stats.ps_free) * PAGE_SIZE) >> KIBI);
+
+            total_present += stats.ps_present;
+            total_free += stats.ps_free;
         }
     }
 
-    npages = page_count(dma_end_addr + 1);
-    dma_numpages = align_ceil(npages, BITMAP_CHUNK_BITS);
-    bitmap_size = bitmap_bytecount(dma_numpages);
-    npages = page_count(bitmap_size);
+    kprintf(KP_INFORM, "pmm: %zu KiB total, %zu KiB free, %zu KiB cached per-CPU", (total_present * PAGE_SIZE) >> KIBI,
+        (total_free * PAGE_SIZE) >> KIBI, (pmm_cached_pages() * PAGE_SIZE) >> KIBI);
+}
+
+size_t pmm_compact(size_t budget)
+{
+    return compact(MAX_NUMA_NODES, budget, SIZE_MAX);
+}
+
+void pmm_register_shrinker(struct pmm_shrinker *restrict shrinker)
+{
+    shrinker->sh_next = shrinkers;
+    shrinkers = shrinker;
+}
+
+void pmm_compact_stats(struct pmm_compact_stats *restrict stats)
+{
+    memcpy(stats, &compact_stats, sizeof(struct pmm_compact_stats));
+}
+
+uintptr_t pmm_alloc_zeroed(void)
+{
+    void **headptr;
+    uintptr_t address;
+    struct pmm_pcp *pcp = &pcps[smp_cpu_index()];
 
-    dma_bitmap = NULL;
-    bitmap_phys = 0;
+    if((headptr = pcp->pc_zeroed) != NULL) {
+        pcp->pc_zeroed = headptr[0];
+        pcp->pc_nzeroed -= 1;
+        headptr[0] = NULL;
 
-    /* Figure out where to put the bitmap */
-    for(i = 0; i < memmap.response->entry_count; ++i) {
-        entry = memmap.response->entries[i];
+        address = hhdm_to_phys(headptr);
+        prep_page(address, 0);
+        return address;
+    }
+
+    /* The pool ran dry; pay for the clear inline */
+    if((address = pmm_alloc()) != 0)
+        memset(phys_to_hhdm(address), 0, PAGE_SIZE);
+    return address;
+}
+
+void *pmm_alloc_zeroed_hhdm(void)
+{
+    uintptr_t address;
+    if((address = pmm_alloc_zeroed()) != 0)
+        return phys_to_hhdm(address);
+    return NULL;
+}
+
+size_t pmm_zero_worker(size_t budget)
+{
+    size_t count;
+    void **headptr;
+    uintptr_t address;
+    struct pmm_pcp *pcp = &pcps[smp_cpu_index()];
 
-        if((entry->type == LIMINE_MEMMAP_USABLE) && (entry->length >= npages)) {
-            dma_bitmap = phys_to_hhdm(entry->base);
-            bitmap_phys = entry->base;
+    for(count = 0; (count < budget) && (pcp->pc_nzeroed < PMM_ZERO_POOL_SIZE); ++count) {
+        /* Freed pages at the cold end of the cache are
+         * the ones least likely to be reused while warm */
+        if(pcp->pc_count)
+            address = pcp_pop_cold(pcp);
+        else if((address = alloc_node(numa_local_node(), 0, 0)) == 0)
             break;
+
+        headptr = phys_to_hhdm(address);
+        ntstore_zero(headptr, PAGE_SIZE);
+        ntstore_fence();
+
+        headptr[0] = pcp->pc_zeroed;
+        pcp->pc_zeroed = headptr;
+        pcp->pc_nzeroed += 1;
+    }
+
+    return count;
+}
+
+void init_pmm(void)
+{
+    unsigned int node, type;
+    size_t page, npages;
+    size_t bitmap_size;
+    size_t array_size;
+    size_t sections_size;
+    size_t buddy_seeded;
+    uintptr_t start, end;
+    uintptr_t max_addr;
+    struct memblock_iter iter;
+
+    for(node = 0; node < MAX_NUMA_NODES; ++node) {
+        for(type = 0; type < MAX_ZONES; ++type) {
+            memset(&zones[node][type], 0, sizeof(struct zone));
+            zones[node][type].zn_node = node;
+            zones[node][type].zn_type = type;
         }
     }
 
-    if(!dma_bitmap) {
-        panic("pmm: out of memory");
+    if((max_addr = memblock_end()) == 0) {
+        panic("pmm: no usable memory");
         unreachable();
     }
 
-    /* FIXME: use memset/bzero instead for faster initiailzation? */
-    bitmap_range_clear(dma_bitmap, 0, dma_numpages - 1);
+    max_addr -= 1;
 
-    /* Figure out what chunks of DMA space are usable */
-    for(i = 0; i < memmap.response->entry_count; ++i) {
-        entry = memmap.response->entries[i];
-
-        if(entry->type == LIMINE_MEMMAP_USABLE) {
-            if((entry->base <= DMA_APPROX_END) && (entry->length != 0)) {
-                npages = page_count(entry->length);
-                page = entry->base / PAGE_SIZE;
-                bitmap_range_set(dma_bitmap, page, page + npages - 1);
-                continue;
-            }
-        }
+    /* Determine the actual end of the DMA space */
+    memset(&iter, 0, sizeof(iter));
+    while(memblock_next_free(&iter, &start, &end)) {
+        if(start > DMA_APPROX_END)
+            break;
+        dma_end_addr = end - 1;
+        if(dma_end_addr > DMA_APPROX_END)
+            dma_end_addr = DMA_APPROX_END;
     }
 
-    /* Account for cases when the bitmap resides
-     * in the very same memory region it tracks. */
-    if(bitmap_phys <= dma_end_addr) {
-        page = bitmap_phys / PAGE_SIZE;
-        npages = page_count(bitmap_size);
-        bitmap_range_clear(dma_bitmap, page, page + npages - 1);
+    npages = page_count(dma_end_addr + 1);
+    dma_numpages = align_ceil(npages, BITMAP_CHUNK_BITS);
+    bitmap_size = page_align_up(bitmap_bytecount(dma_numpages));
+
+    /* The page array covers every page frame up to
+     * the end of the physical address space; most of it
+     * is only initialized once a section gets seeded */
+    page_array_count = page_count(max_addr + 1);
+    array_size = page_align_up(page_array_count * sizeof(struct page));
+    sections_size = page_align_up(bitmap_bytecount(((page_array_count - 1) >> PMM_MAX_ORDER) + 1));
+
+    dma_bitmap = memblock_alloc_hhdm(bitmap_size, PAGE_SIZE);
+    page_array = memblock_alloc_hhdm(array_size, PAGE_SIZE);
+    sections = memblock_alloc_hhdm(sections_size, PAGE_SIZE);
+
+    if(!dma_bitmap || !page_array || !sections) {
+        panic("pmm: out of memory");
+        unreachable();
     }
 
-    list_numpages = 0;
+    memset(dma_bitmap, 0, bitmap_size);
+    memset(sections, 0, sections_size);
 
-    /* Figure out what pages belong to the linked list */
-    for(i = 0; i < memmap.response->entry_count; ++i) {
-        entry = memmap.response->entries[i];
+    /* The first section spans the whole DMA zone
+     * which does not go through lazy seeding at all */
+    init_section(0);
 
-        if((entry->type == LIMINE_MEMMAP_USABLE) && (entry->base > dma_end_addr)) {
-            for(address = 0; address < entry->length; address += PAGE_SIZE) {
-                head_ptr = phys_to_hhdm(entry->base + address);
-                head_ptr[0] = page_list;
-                page_list = head_ptr;
-                list_numpages += 1;
-            }
+    dma_zone = &zones[addr_node(0)][ZONE_DMA];
+
+    /* From now on memblock's view of free memory
+     * is final; everything it still has is ours */
+    memblock_handover();
+
+    buddy_seeded = 0;
+
+    num_extents = 0;
+
+    memset(&iter, 0, sizeof(iter));
+    while(memblock_next_free(&iter, &start, &end)) {
+        start = page_align_up(start);
+        end = page_align(end);
+
+        if(start >= end)
+            continue;
+
+        /* Figure out what chunks of DMA space are usable */
+        if(start <= dma_end_addr) {
+            page = start / PAGE_SIZE;
+            npages = page_count(((end > (dma_end_addr + 1)) ? (dma_end_addr + 1) : end) - start);
+            bitmap_range_set(dma_bitmap, page, page + npages - 1);
+            dma_zone->zn_present_pages += npages;
+            start += npages * PAGE_SIZE;
+        }
+
+        /* Everything else belongs to the buddy allocator */
+        if(start < end) {
+            buddy_seeded += buddy_seed(start, end);
         }
     }
 
+    dma_zone->zn_free_pages = dma_zone->zn_present_pages;
+
     kprintf(KP_INFORM, "pmm: bitmap is tracking %zu pages", dma_numpages);
-    kprintf(KP_INFORM, "pmm: linked list is tracking %zu pages", list_numpages);
+    kprintf(KP_INFORM, "pmm: buddy allocator is tracking %zu pages", buddy_seeded);
+    kprintf(KP_INFORM, "pmm: page array takes %zu KiB", array_size >> KIBI);
+
+    pmm_print_stats();
 }
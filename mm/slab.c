@@ -1,91 +1,907 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
+#include <iecprefix.h>
 #include <kern/assert.h>
 #include <kern/panic.h>
 #include <kern/printf.h>
+#include <kern/smp.h>
+#include <mm/hhdm.h>
+#include <mm/kmalloc.h>
 #include <mm/page.h>
 #include <mm/pmm.h>
 #include <mm/slab.h>
 #include <string.h>
+#include <vex/errno.h>
 
-struct slab {
-    size_t sl_blocksize;
-    void **sl_head;
+struct slab_magazine {
+    struct slab_magazine *mg_next;
+    size_t mg_count;
+    void *mg_objs[SLAB_MAGAZINE_SIZE];
 };
 
-static size_t num_slab = 0;
-static struct slab *slabs = NULL;
+struct slab_cpu {
+    struct slab_magazine *sc_loaded;
+    struct slab_magazine *sc_previous;
+    size_t sc_allocs;
+    size_t sc_frees;
+};
+
+struct slab_site {
+    void *si_caller;
+    size_t si_samples;
+};
+
+/* Bytes allocated on the CPU since its last sample */
+struct slab_profile_cpu {
+    size_t pc_bytes;
+} __aligned(CACHELINE_SIZE);
+
+struct kmem_cache {
+    const char *kc_name;
+    size_t kc_size;
+    size_t kc_align;
+    size_t kc_stride;
+    size_t kc_offset;
+    size_t kc_freeptr;
+    size_t kc_objcount;
+    kmem_ctor_t kc_ctor;
+    struct slab_page *kc_partial;
+    struct slab_page *kc_full;
+    struct slab_page *kc_empty;
+    struct slab_magazine *kc_depot_full;
+    struct slab_magazine *kc_depot_empty;
+    size_t kc_nempty;
+    size_t kc_npages;
+    size_t kc_index;
+    size_t kc_allocs;
+    size_t kc_frees;
+    size_t kc_failures;
+#if SLAB_DEBUG
+    size_t kc_objoff;
+    size_t kc_track;
+#endif
+    struct kmem_cache *kc_next;
+};
+
+/* Every slab is a single page that starts
+ * with this header; objects follow it */
+struct slab_page {
+    struct kmem_cache *sp_cache;
+    struct slab_page *sp_next;
+    struct slab_page *sp_prev;
+    void *sp_free;
+    size_t sp_inuse;
+};
+
+#if SLAB_DEBUG
+#define SLAB_REDZONE_SIZE   sizeof(void *)
+#define SLAB_REDZONE_BYTE   0xBB
+#define SLAB_POISON_FREE    0x6B
+#define SLAB_POISON_ALLOC   0xA5
+#define SLAB_STATE_FREE     0x46524545U
+#define SLAB_STATE_ALLOC    0x414C4C43U
+
+/* Kept right after the free list pointer */
+struct slab_track {
+    void *st_alloc;
+    void *st_free;
+    size_t st_state;
+};
+#endif
+
+/* Only ever looked at with SLAB_DEBUG or
+ * while the allocation profiler is running */
+#define SLAB_CALLER __builtin_return_address(0)
+
+#define SLAB_MIN_SIZE sizeof(void *)
+#define SLAB_NUM_CLASSES 14
+
+/* Small sizes are looked up in steps of 8
+ * bytes; anything past that is either a power
+ * of two or sits halfway between two of them */
+#define SLAB_SMALL_SIZE 128
+#define SLAB_SMALL_SHIFT 3
+
+struct size_class {
+    const char *sc_name;
+    size_t sc_size;
+};
+
+static const struct size_class classes[SLAB_NUM_CLASSES] = {
+    { "slab-8",   8    }, { "slab-16",  16   }, { "slab-24",  24   },
+    { "slab-32",  32   }, { "slab-48",  48   }, { "slab-64",  64   },
+    { "slab-96",  96   }, { "slab-128", 128  }, { "slab-192", 192  },
+    { "slab-256", 256  }, { "slab-384", 384  }, { "slab-512", 512  },
+    { "slab-768", 768  }, { "slab-1024", 1024 },
+};
+
+static const unsigned char small_classes[(SLAB_SMALL_SIZE >> SLAB_SMALL_SHIFT) + 1] = {
+    0,                      /* 0 */
+    0, 1, 2, 3, 4, 4, 5, 5, /* 8 - 64 */
+    6, 6, 6, 6, 7, 7, 7, 7, /* 72 - 128 */
+};
+
+static struct kmem_cache cache_cache = { 0 };
+static struct kmem_cache magazine_cache = { 0 };
+static struct kmem_cache *caches = NULL;
+
+/* Laid out per CPU so that each CPU's magazine
+ * pointers for all the caches share cache lines
+ * with nothing that other CPUs write to */
+static struct slab_cpu slab_cpus[MAX_CPUS][SLAB_MAX_CACHES] __aligned(CACHELINE_SIZE);
+static struct kmem_cache *cache_slots[SLAB_MAX_CACHES] = { 0 };
+
+static size_t profile_rate = 0;
+static size_t profile_dropped = 0;
+static struct slab_profile_cpu profile_cpus[MAX_CPUS] = { 0 };
+static struct slab_site profile_sites[SLAB_PROFILE_SITES] = { 0 };
+
+static struct pmm_shrinker slab_shrinker = { 0 };
+static struct kmem_cache *size_caches[SLAB_NUM_CLASSES] = { 0 };
+
+static __always_inline __nodiscard inline struct slab_page *ptr_to_slab(const void *restrict ptr)
+{
+    return (struct slab_page *)(page_align_const_ptr(ptr));
+}
+
+static __always_inline __nodiscard inline int is_slab_ptr(const void *restrict ptr)
+{
+    if(vmalloc_contains(ptr))
+        return 0;
+    return phys_to_page(hhdm_to_phys(ptr))->pg_flags & PG_SLAB;
+}
+
+static __always_inline __nodiscard inline void **freeptr(const struct kmem_cache *restrict cache, void *restrict obj)
+{
+    return (void **)((uintptr_t)obj + cache->kc_freeptr);
+}
+
+static __always_inline __nodiscard inline size_t obj_offset(const struct kmem_cache *restrict cache)
+{
+#if SLAB_DEBUG
+    return cache->kc_objoff;
+#else
+    return 0;
+#endif
+}
+
+#if SLAB_DEBUG
+static __always_inline __nodiscard inline struct slab_track *obj_track(const struct kmem_cache *restrict cache, const void *restrict obj)
+{
+    return (struct slab_track *)((uintptr_t)obj + cache->kc_track);
+}
+
+static int check_bytes(const void *restrict ptr, unsigned char value, size_t sz)
+{
+    const unsigned char *bp = ptr;
+
+    while(sz--) {
+        if(*bp++ != value) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void debug_init(const struct kmem_cache *restrict cache, void *restrict obj)
+{
+    struct slab_track *track = obj_track(cache, obj);
+
+    memset((void *)((uintptr_t)obj - cache->kc_objoff), SLAB_REDZONE_BYTE, cache->kc_objoff);
+    memset((void *)((uintptr_t)obj + cache->kc_size), SLAB_REDZONE_BYTE, cache->kc_freeptr - cache->kc_size);
+
+    /* Poisoning would wreck the constructed state */
+    if(!cache->kc_ctor)
+        memset(obj, SLAB_POISON_FREE, cache->kc_size);
+
+    track->st_alloc = NULL;
+    track->st_free = NULL;
+    track->st_state = SLAB_STATE_FREE;
+}
+
+static void debug_check(const struct kmem_cache *restrict cache, const void *restrict obj)
+{
+    const struct slab_page *sp = ptr_to_slab(obj);
+    uintptr_t first = (uintptr_t)sp + cache->kc_offset + cache->kc_objoff;
+    const struct slab_track *track;
+
+    if(((uintptr_t)obj < first) || (((uintptr_t)obj - first) % cache->kc_stride) || ((((uintptr_t)obj - first) / cache->kc_stride) >= cache->kc_objcount)) {
+        panic("slab: %s: %p is not an object", cache->kc_name, obj);
+        unreachable();
+    }
+
+    track = obj_track(cache, obj);
+
+    if(!check_bytes((const void *)((uintptr_t)obj - cache->kc_objoff), SLAB_REDZONE_BYTE, cache->kc_objoff)) {
+        panic("slab: %s: %p: underrun, allocated by %p", cache->kc_name, obj, track->st_alloc);
+        unreachable();
+    }
+
+    if(!check_bytes((const void *)((uintptr_t)obj + cache->kc_size), SLAB_REDZONE_BYTE, cache->kc_freeptr - cache->kc_size)) {
+        panic("slab: %s: %p: overrun, allocated by %p", cache->kc_name, obj, track->st_alloc);
+        unreachable();
+    }
+}
+
+static void debug_alloc(const struct kmem_cache *restrict cache, void *restrict obj, void *restrict caller)
+{
+    struct slab_track *track = obj_track(cache, obj);
+
+    debug_check(cache, obj);
+
+    if(track->st_state != SLAB_STATE_FREE) {
+        panic("slab: %s: %p: corrupted free list, allocated by %p", cache->kc_name, obj, track->st_alloc);
+        unreachable();
+    }
+
+    if(!cache->kc_ctor) {
+        if(!check_bytes(obj, SLAB_POISON_FREE, cache->kc_size)) {
+            panic("slab: %s: %p: modified after free, freed by %p", cache->kc_name, obj, track->st_free);
+            unreachable();
+        }
+
+        memset(obj, SLAB_POISON_ALLOC, cache->kc_size);
+    }
+
+    track->st_alloc = caller;
+    track->st_state = SLAB_STATE_ALLOC;
+}
 
-static __always_inline __nodiscard inline size_t calc_blocksize(size_t index)
+static void debug_free(const struct kmem_cache *restrict cache, void *restrict obj, void *restrict caller)
 {
-    return ((1 << index) * sizeof(void *));
+    struct slab_track *track = obj_track(cache, obj);
+
+    debug_check(cache, obj);
+
+    if(track->st_state != SLAB_STATE_ALLOC) {
+        panic("slab: %s: %p: double free, freed by %p", cache->kc_name, obj, track->st_free);
+        unreachable();
+    }
+
+    if(!cache->kc_ctor)
+        memset(obj, SLAB_POISON_FREE, cache->kc_size);
+
+    track->st_free = caller;
+    track->st_state = SLAB_STATE_FREE;
+}
+#endif
+
+static void list_insert(struct slab_page **restrict list, struct slab_page *restrict sp)
+{
+    sp->sp_prev = NULL;
+    sp->sp_next = list[0];
+
+    if(list[0])
+        list[0]->sp_prev = sp;
+    list[0] = sp;
 }
 
-static struct slab *find_slab(size_t sz)
+static void list_remove(struct slab_page **restrict list, struct slab_page *restrict sp)
+{
+    if(sp->sp_prev)
+        sp->sp_prev->sp_next = sp->sp_next;
+    else list[0] = sp->sp_next;
+
+    if(sp->sp_next)
+        sp->sp_next->sp_prev = sp->sp_prev;
+    sp->sp_next = NULL;
+    sp->sp_prev = NULL;
+}
+
+static struct slab_page *expand_cache(struct kmem_cache *restrict cache)
 {
     size_t i;
+    void *obj;
+    struct slab_page *sp;
+
+    if((sp = pmm_alloc_hhdm()) != NULL) {
+        phys_to_page(hhdm_to_phys(sp))->pg_flags |= PG_SLAB;
+
+        sp->sp_cache = cache;
+        sp->sp_free = NULL;
+        sp->sp_inuse = 0;
+
+        /* Thread the free list backwards so
+         * that objects are handed out in order */
+        for(i = cache->kc_objcount; i-- > 0;) {
+            obj = (void *)((uintptr_t)sp + cache->kc_offset + i * cache->kc_stride + obj_offset(cache));
+            if(cache->kc_ctor)
+                cache->kc_ctor(obj);
+#if SLAB_DEBUG
+            debug_init(cache, obj);
+#endif
+            freeptr(cache, obj)[0] = sp->sp_free;
+            sp->sp_free = obj;
+        }
 
-    /* Try to find exact size match */
-    for(i = 0; slabs[i].sl_blocksize; ++i) {
-        if(slabs[i].sl_blocksize == sz)
-            return &slabs[i];
-        continue;
+        list_insert(&cache->kc_empty, sp);
+        cache->kc_nempty += 1;
+        cache->kc_npages += 1;
+        return sp;
     }
 
-    /* Give up and find anything that fits */
-    for(i = 0; slabs[i].sl_blocksize; ++i) {
-        if(slabs[i].sl_blocksize >= sz)
-            return &slabs[i];
-        continue;
+    cache->kc_failures += 1;
+    return NULL;
+}
+
+static int cache_init(struct kmem_cache *restrict cache, const char *restrict name, size_t size, size_t align, kmem_ctor_t ctor)
+{
+    if(align < SLAB_MIN_SIZE)
+        align = SLAB_MIN_SIZE;
+    kassert(!(align & (align - 1)));
+
+    cache->kc_name = name;
+    cache->kc_size = size;
+    cache->kc_align = align;
+    cache->kc_ctor = ctor;
+    cache->kc_freeptr = 0;
+    cache->kc_stride = size;
+
+#if SLAB_DEBUG
+    /* The left redzone keeps the object aligned; the
+     * right one runs up to the free list pointer that is
+     * kept outside of the object so that it can be poisoned */
+    cache->kc_objoff = align_ceil(SLAB_REDZONE_SIZE, align);
+    cache->kc_freeptr = align_ceil(size, sizeof(void *)) + SLAB_REDZONE_SIZE;
+    cache->kc_track = cache->kc_freeptr + sizeof(void *);
+    cache->kc_stride = cache->kc_objoff + cache->kc_track + sizeof(struct slab_track);
+#else
+    /* Constructed objects must survive being
+     * on the free list, so the free list pointer
+     * goes past the end of the object instead */
+    if(ctor) {
+        cache->kc_freeptr = align_ceil(size, sizeof(void *));
+        cache->kc_stride = cache->kc_freeptr + sizeof(void *);
+    }
+#endif
+
+    if(cache->kc_stride < SLAB_MIN_SIZE)
+        cache->kc_stride = SLAB_MIN_SIZE;
+    cache->kc_stride = align_ceil(cache->kc_stride, align);
+    cache->kc_offset = align_ceil(sizeof(struct slab_page), align);
+
+    if((cache->kc_offset + cache->kc_stride) > PAGE_SIZE)
+        return 0;
+    cache->kc_objcount = (PAGE_SIZE - cache->kc_offset) / cache->kc_stride;
+
+    cache->kc_partial = NULL;
+    cache->kc_full = NULL;
+    cache->kc_empty = NULL;
+    cache->kc_depot_full = NULL;
+    cache->kc_depot_empty = NULL;
+    cache->kc_nempty = 0;
+    cache->kc_npages = 0;
+    cache->kc_index = SLAB_MAX_CACHES;
+    cache->kc_allocs = 0;
+    cache->kc_frees = 0;
+    cache->kc_failures = 0;
+
+    cache->kc_next = caches;
+    caches = cache;
+
+    return 1;
+}
+
+static void *slab_get(struct kmem_cache *restrict cache)
+{
+    void *obj;
+    struct slab_page *sp;
+
+    if((sp = cache->kc_partial) == NULL) {
+        if((sp = cache->kc_empty) == NULL && (sp = expand_cache(cache)) == NULL)
+            return NULL;
+        list_remove(&cache->kc_empty, sp);
+        list_insert(&cache->kc_partial, sp);
+        cache->kc_nempty -= 1;
+    }
+
+    obj = sp->sp_free;
+    sp->sp_free = freeptr(cache, obj)[0];
+    sp->sp_inuse += 1;
+
+    if(sp->sp_inuse >= cache->kc_objcount) {
+        list_remove(&cache->kc_partial, sp);
+        list_insert(&cache->kc_full, sp);
+    }
+
+    return obj;
+}
+
+static void slab_put(struct kmem_cache *restrict cache, void *restrict ptr)
+{
+    struct slab_page *sp = ptr_to_slab(ptr);
+
+    kassert(sp->sp_inuse != 0);
+
+    if(sp->sp_inuse >= cache->kc_objcount) {
+        list_remove(&cache->kc_full, sp);
+        list_insert(&cache->kc_partial, sp);
+    }
+
+    freeptr(cache, ptr)[0] = sp->sp_free;
+    sp->sp_free = ptr;
+    sp->sp_inuse -= 1;
+
+    if(sp->sp_inuse == 0) {
+        list_remove(&cache->kc_partial, sp);
+
+        if(cache->kc_nempty >= SLAB_EMPTY_WATERMARK) {
+            cache->kc_npages -= 1;
+            pmm_free_hhdm(sp);
+            return;
+        }
+
+        list_insert(&cache->kc_empty, sp);
+        cache->kc_nempty += 1;
+    }
+}
+
+static size_t release_empty(struct kmem_cache *restrict cache)
+{
+    size_t count = 0;
+    struct slab_page *sp;
+
+    while((sp = cache->kc_empty) != NULL) {
+        list_remove(&cache->kc_empty, sp);
+        pmm_free_hhdm(sp);
+        count += 1;
+    }
+
+    cache->kc_nempty = 0;
+    cache->kc_npages -= count;
+
+    return count;
+}
+
+static void magazine_flush(struct kmem_cache *restrict cache, struct slab_magazine *restrict mag)
+{
+    while(mag->mg_count)
+        slab_put(cache, mag->mg_objs[--mag->mg_count]);
+    slab_put(&magazine_cache, mag);
+}
+
+static void cache_drain(struct kmem_cache *restrict cache)
+{
+    size_t i;
+    struct slab_cpu *cpu;
+    struct slab_magazine *mag;
+
+    if(cache->kc_index < SLAB_MAX_CACHES) {
+        for(i = 0; i < MAX_CPUS; ++i) {
+            cpu = &slab_cpus[i][cache->kc_index];
+
+            if(cpu->sc_loaded)
+                magazine_flush(cache, cpu->sc_loaded);
+            if(cpu->sc_previous)
+                magazine_flush(cache, cpu->sc_previous);
+            cpu->sc_loaded = NULL;
+            cpu->sc_previous = NULL;
+        }
+    }
+
+    while((mag = cache->kc_depot_full) != NULL) {
+        cache->kc_depot_full = mag->mg_next;
+        magazine_flush(cache, mag);
+    }
+
+    while((mag = cache->kc_depot_empty) != NULL) {
+        cache->kc_depot_empty = mag->mg_next;
+        magazine_flush(cache, mag);
+    }
+}
+
+struct kmem_cache *kmem_cache_create(const char *restrict name, size_t size, size_t align, kmem_ctor_t ctor)
+{
+    size_t i, j;
+    struct kmem_cache *cache;
+
+    if((cache = slab_get(&cache_cache)) != NULL) {
+        if(cache_init(cache, name, size, align, ctor)) {
+            for(i = 0; i < SLAB_MAX_CACHES; ++i) {
+                if(cache_slots[i])
+                    continue;
+                cache_slots[i] = cache;
+                cache->kc_index = i;
+
+                /* The slot may have been used before */
+                for(j = 0; j < MAX_CPUS; ++j) {
+                    slab_cpus[j][i].sc_allocs = 0;
+                    slab_cpus[j][i].sc_frees = 0;
+                }
+
+                break;
+            }
+
+            return cache;
+        }
+
+        slab_put(&cache_cache, cache);
     }
 
     return NULL;
 }
 
-static int expand_slab(struct slab *restrict sl)
+void kmem_cache_destroy(struct kmem_cache *restrict cache)
+{
+    struct kmem_cache **link;
+
+    cache_drain(cache);
+
+    kassert_msg(!cache->kc_partial && !cache->kc_full, "slab: destroying a cache that is still in use");
+
+    release_empty(cache);
+
+    for(link = &caches; link[0]; link = &link[0]->kc_next) {
+        if(link[0] == cache) {
+            link[0] = cache->kc_next;
+            break;
+        }
+    }
+
+    if(cache->kc_index < SLAB_MAX_CACHES)
+        cache_slots[cache->kc_index] = NULL;
+    slab_put(&cache_cache, cache);
+}
+
+static __always_inline inline void *magazine_alloc(struct kmem_cache *restrict cache)
+{
+    struct slab_cpu *cpu;
+    struct slab_magazine *mag;
+
+    if(predict_false(cache->kc_index >= SLAB_MAX_CACHES))
+        return slab_get(cache);
+    cpu = &slab_cpus[smp_cpu_index()][cache->kc_index];
+
+    if(predict_true(cpu->sc_loaded && cpu->sc_loaded->mg_count))
+        return cpu->sc_loaded->mg_objs[--cpu->sc_loaded->mg_count];
+
+    if(cpu->sc_previous && cpu->sc_previous->mg_count) {
+        mag = cpu->sc_loaded;
+        cpu->sc_loaded = cpu->sc_previous;
+        cpu->sc_previous = mag;
+        return cpu->sc_loaded->mg_objs[--cpu->sc_loaded->mg_count];
+    }
+
+    /* FIXME: the depot and the slab layer
+     * are shared between CPUs and need a lock */
+    if((mag = cache->kc_depot_full) != NULL) {
+        cache->kc_depot_full = mag->mg_next;
+
+        if(cpu->sc_previous) {
+            cpu->sc_previous->mg_next = cache->kc_depot_empty;
+            cache->kc_depot_empty = cpu->sc_previous;
+        }
+
+        cpu->sc_previous = cpu->sc_loaded;
+        cpu->sc_loaded = mag;
+        return mag->mg_objs[--mag->mg_count];
+    }
+
+    return slab_get(cache);
+}
+
+static __always_inline inline void magazine_free(struct kmem_cache *restrict cache, void *restrict ptr)
+{
+    struct slab_cpu *cpu;
+    struct slab_magazine *mag;
+
+    if(predict_false(cache->kc_index >= SLAB_MAX_CACHES)) {
+        slab_put(cache, ptr);
+        return;
+    }
+
+    cpu = &slab_cpus[smp_cpu_index()][cache->kc_index];
+
+    if(predict_true(cpu->sc_loaded && (cpu->sc_loaded->mg_count < SLAB_MAGAZINE_SIZE))) {
+        cpu->sc_loaded->mg_objs[cpu->sc_loaded->mg_count++] = ptr;
+        return;
+    }
+
+    if(cpu->sc_previous && (cpu->sc_previous->mg_count == 0)) {
+        mag = cpu->sc_loaded;
+        cpu->sc_loaded = cpu->sc_previous;
+        cpu->sc_previous = mag;
+        cpu->sc_loaded->mg_objs[cpu->sc_loaded->mg_count++] = ptr;
+        return;
+    }
+
+    /* Objects freed on a CPU other than the one that
+     * allocated them only reach the slab layer once a
+     * whole magazine of them is flushed out of the depot */
+    if((mag = cache->kc_depot_empty) != NULL)
+        cache->kc_depot_empty = mag->mg_next;
+    else if((mag = slab_get(&magazine_cache)) != NULL)
+        mag->mg_count = 0;
+
+    if(mag == NULL) {
+        slab_put(cache, ptr);
+        return;
+    }
+
+    if(cpu->sc_previous) {
+        cpu->sc_previous->mg_next = cache->kc_depot_full;
+        cache->kc_depot_full = cpu->sc_previous;
+    }
+
+    cpu->sc_previous = cpu->sc_loaded;
+    cpu->sc_loaded = mag;
+    mag->mg_objs[mag->mg_count++] = ptr;
+}
+
+static void profile_record(void *restrict caller, size_t samples)
+{
+    size_t i, index;
+
+    /* FIXME: the site table is shared between CPUs and needs a lock */
+    index = (size_t)(((uintptr_t)caller * UINT64_C(0x9E3779B97F4A7C15)) >> 32) % SLAB_PROFILE_SITES;
+
+    for(i = 0; i < SLAB_PROFILE_SITES; ++i) {
+        if(profile_sites[index].si_caller == caller || profile_sites[index].si_caller == NULL) {
+            profile_sites[index].si_caller = caller;
+            profile_sites[index].si_samples += samples;
+            return;
+        }
+
+        index = (index + 1) % SLAB_PROFILE_SITES;
+    }
+
+    profile_dropped += samples;
+}
+
+static __always_inline inline void profile_account(size_t sz, void *restrict caller)
+{
+    struct slab_profile_cpu *pc = &profile_cpus[smp_cpu_index()];
+
+    /* Sampling by bytes rather than by calls makes
+     * large allocations proportionally more likely to
+     * show up, so samples times the rate estimates bytes */
+    pc->pc_bytes += sz;
+
+    if(pc->pc_bytes >= profile_rate) {
+        profile_record(caller, pc->pc_bytes / profile_rate);
+        pc->pc_bytes %= profile_rate;
+    }
+}
+
+static __always_inline inline void *cache_alloc(struct kmem_cache *restrict cache, void *restrict caller)
+{
+    void *obj = magazine_alloc(cache);
+
+    if(predict_true(obj != NULL)) {
+        if(predict_true(cache->kc_index < SLAB_MAX_CACHES))
+            slab_cpus[smp_cpu_index()][cache->kc_index].sc_allocs += 1;
+        else cache->kc_allocs += 1;
+
+        if(predict_false(profile_rate != 0))
+            profile_account(cache->kc_size, caller);
+#if SLAB_DEBUG
+        debug_alloc(cache, obj, caller);
+#endif
+    }
+
+    return obj;
+}
+
+static __always_inline inline void cache_free(struct kmem_cache *restrict cache, void *restrict ptr, void *restrict caller)
+{
+    kassert(ptr_to_slab(ptr)->sp_cache == cache);
+#if SLAB_DEBUG
+    debug_free(cache, ptr, caller);
+#endif
+
+    if(predict_true(cache->kc_index < SLAB_MAX_CACHES))
+        slab_cpus[smp_cpu_index()][cache->kc_index].sc_frees += 1;
+    else cache->kc_frees += 1;
+
+    magazine_free(cache, ptr);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *restrict cache)
+{
+    return cache_alloc(cache, SLAB_CALLER);
+}
+
+void kmem_cache_free(struct kmem_cache *restrict cache, void *restrict ptr)
+{
+    cache_free(cache, ptr, SLAB_CALLER);
+}
+
+void kmem_cache_dump(const struct kmem_cache *restrict cache)
+{
+#if SLAB_DEBUG
+    size_t i, j;
+    const void *obj;
+    const struct slab_page *sp;
+    const struct slab_track *track;
+    const struct slab_page *lists[2];
+#endif
+
+    kprintf(KP_DEBUG, "slab: %s: size %zu, stride %zu, %zu per page, %zu pages", cache->kc_name,
+        cache->kc_size, cache->kc_stride, cache->kc_objcount, cache->kc_npages);
+
+#if SLAB_DEBUG
+    lists[0] = cache->kc_partial;
+    lists[1] = cache->kc_full;
+
+    for(i = 0; i < 2; ++i) {
+        for(sp = lists[i]; sp; sp = sp->sp_next) {
+            for(j = 0; j < cache->kc_objcount; ++j) {
+                obj = (const void *)((uintptr_t)sp + cache->kc_offset + j * cache->kc_stride + cache->kc_objoff);
+                track = obj_track(cache, obj);
+                if(track->st_state != SLAB_STATE_ALLOC)
+                    continue;
+                kprintf(KP_DEBUG, "slab: %s: %p allocated by %p", cache->kc_name, obj, track->st_alloc);
+            }
+        }
+    }
+#endif
+}
+
+void slab_dump(void)
+{
+    const struct kmem_cache *cache;
+
+    for(cache = caches; cache; cache = cache->kc_next) {
+        kmem_cache_dump(cache);
+    }
+}
+
+void kmem_cache_get_stats(const struct kmem_cache *restrict cache, struct slab_stats *restrict stats)
 {
     size_t i;
-    size_t header;
-    size_t count, gap;
 
-    kassert((sl->sl_blocksize / sizeof(void *)) >= 1);
-    kassert((sl->sl_blocksize % sizeof(void *)) == 0);
+    stats->ss_allocs = cache->kc_allocs;
+    stats->ss_frees = cache->kc_frees;
+    stats->ss_pages = cache->kc_npages;
+    stats->ss_failures = cache->kc_failures;
 
-    if((sl->sl_head = pmm_alloc_hhdm()) != NULL) {
-        header = align_ceil(sizeof(struct slab *), sl->sl_blocksize);
+    if(cache->kc_index < SLAB_MAX_CACHES) {
+        for(i = 0; i < MAX_CPUS; ++i) {
+            stats->ss_allocs += slab_cpus[i][cache->kc_index].sc_allocs;
+            stats->ss_frees += slab_cpus[i][cache->kc_index].sc_frees;
+        }
+    }
 
-        sl->sl_head[0] = sl;
-        sl->sl_head = (void **)((uintptr_t)sl->sl_head + header);
+    /* Objects freed on another CPU than the one that
+     * allocated them make single CPUs go out of balance,
+     * the wrapped around sums still come out right */
+    stats->ss_active = stats->ss_allocs - stats->ss_frees;
+}
 
-        /* Each page contains a chunk of the linked list
-         * prepended with a header that takes at least a single
-         * block of sl_blocksize bytes off the available space */
-        count = align_floor((PAGE_SIZE - header), sl->sl_blocksize) / sl->sl_blocksize;
-        gap = sl->sl_blocksize / sizeof(void *);
+void slab_print_stats(void)
+{
+    struct slab_stats stats;
+    const struct kmem_cache *cache;
 
-        for(i = 1; i < count; ++i)
-            sl->sl_head[gap * (i - 1)] = &sl->sl_head[gap * i];
-        sl->sl_head[gap * (count - 1)] = NULL;
+    for(cache = caches; cache; cache = cache->kc_next) {
+        kmem_cache_get_stats(cache, &stats);
 
-        return 1;
+        kprintf(KP_INFORM, "slab: %s: %zu active, %zu allocs, %zu frees, %zu pages, %zu failures", cache->kc_name,
+            stats.ss_active, stats.ss_allocs, stats.ss_frees, stats.ss_pages, stats.ss_failures);
     }
+}
+
+int slab_profile_start(size_t rate)
+{
+    if(rate == 0)
+        return EINVAL;
+
+    profile_rate = 0;
+    profile_dropped = 0;
+
+    memset(profile_cpus, 0, sizeof(profile_cpus));
+    memset(profile_sites, 0, sizeof(profile_sites));
+
+    profile_rate = rate;
 
     return 0;
 }
 
-void *slab_alloc(size_t sz)
+void slab_profile_stop(void)
 {
-    struct slab *sl;
-    void **headptr;
+    profile_rate = 0;
+}
 
-    if((sl = find_slab(sz)) != NULL) {
-        if(!sl->sl_head && !expand_slab(sl))
-            return NULL;
-        
-        headptr = sl->sl_head;
-        sl->sl_head = headptr[0];
-        return headptr;
+void slab_profile_sample(size_t sz, void *restrict caller)
+{
+    if(predict_false(profile_rate != 0)) {
+        profile_account(sz, caller);
+    }
+}
+
+void slab_profile_dump(void)
+{
+    size_t i;
+    size_t rate = profile_rate;
+
+    if(rate == 0) {
+        kprintf(KP_INFORM, "slab: profiler is not running");
+        return;
+    }
+
+    for(i = 0; i < SLAB_PROFILE_SITES; ++i) {
+        if(profile_sites[i].si_caller == NULL)
+            continue;
+        kprintf(KP_INFORM, "slab: profile: %p: %zu samples, ~%zu KiB", profile_sites[i].si_caller,
+            profile_sites[i].si_samples, (profile_sites[i].si_samples * rate) >> KIBI);
     }
 
+    if(profile_dropped)
+        kprintf(KP_INFORM, "slab: profile: %zu samples dropped", profile_dropped);
+}
+
+size_t kmem_cache_shrink(struct kmem_cache *restrict cache)
+{
+    struct slab_magazine *mag;
+
+    /* Only the depot is flushed; per-CPU magazines
+     * are left alone as they are about to be used anyway */
+    while((mag = cache->kc_depot_full) != NULL) {
+        cache->kc_depot_full = mag->mg_next;
+        magazine_flush(cache, mag);
+    }
+
+    while((mag = cache->kc_depot_empty) != NULL) {
+        cache->kc_depot_empty = mag->mg_next;
+        magazine_flush(cache, mag);
+    }
+
+    return release_empty(cache);
+}
+
+size_t slab_shrink(void)
+{
+    size_t count = 0;
+    struct kmem_cache *cache;
+
+    for(cache = caches; cache; cache = cache->kc_next) {
+        if(cache == &magazine_cache)
+            continue;
+        count += kmem_cache_shrink(cache);
+    }
+
+    /* Flushing the depots above has freed magazines */
+    return count + release_empty(&magazine_cache);
+}
+
+static __always_inline __nodiscard inline size_t size_class(size_t sz)
+{
+    unsigned int order;
+
+    if(sz <= SLAB_SMALL_SIZE)
+        return small_classes[(sz + (UINT64_C(1) << SLAB_SMALL_SHIFT) - 1) >> SLAB_SMALL_SHIFT];
+
+    /* The size falls between 2^(order-1) and 2^order; the class
+     * in between them covers the lower half of that range */
+    order = (sizeof(unsigned long) * 8) - __builtin_clzl(sz - 1);
+
+    if(sz <= (UINT64_C(3) << (order - 2)))
+        return 2 * order - 8;
+    return 2 * order - 7;
+}
+
+static __always_inline __nodiscard inline struct kmem_cache *find_cache(size_t sz)
+{
+    if(predict_true(sz <= SLAB_MAX_SIZE))
+        return size_caches[size_class(sz)];
+    return NULL;
+}
+
+void *slab_alloc(size_t sz)
+{
+    struct kmem_cache *cache;
+
+    if((cache = find_cache(sz)) != NULL)
+        return cache_alloc(cache, SLAB_CALLER);
+    return NULL;
+}
+
+void *slab_alloc_caller(size_t sz, void *restrict caller)
+{
+    struct kmem_cache *cache;
+
+    if((cache = find_cache(sz)) != NULL)
+        return cache_alloc(cache, caller);
     return NULL;
 }
 
@@ -99,22 +915,14 @@ void *slab_calloc(size_t count, size_t sz)
 
 void *slab_realloc(void *restrict ptr, size_t sz)
 {
-    struct slab *sl;
-    void **headptr;
     void *newptr;
 
+    /* Blocks stay where they are as long as the size
+     * class does not change and growth past the largest
+     * class moves over to the large allocation path */
     if(ptr != NULL) {
-        if((newptr = slab_alloc(sz)) != NULL) {
-            sl = ((struct slab **)(page_align_ptr(ptr)))[0];
-
-            memcpy(newptr, ptr, sl->sl_blocksize);
-
-            headptr = ptr;
-            headptr[0] = sl->sl_head;
-            sl->sl_head = headptr;
-
+        if((newptr = krealloc(ptr, sz, 0)) != NULL)
             return newptr;
-        }
 
         slab_free(ptr);
 
@@ -126,45 +934,69 @@ void *slab_realloc(void *restrict ptr, size_t sz)
 
 void slab_free(void *restrict ptr)
 {
-    struct slab *sl;
-    void **headptr;
-
     if(ptr != NULL) {
-        sl = ((struct slab **)(page_align_ptr(ptr)))[0];
-
-        headptr = ptr;
-        headptr[0] = sl->sl_head;
-        sl->sl_head = headptr;
+        /* Whatever slab_realloc has moved
+         * to the large allocation path */
+        if(!is_slab_ptr(ptr)) {
+            kfree(ptr);
+            return;
+        }
 
+        cache_free(ptr_to_slab(ptr)->sp_cache, ptr, SLAB_CALLER);
         return;
     }
 }
 
+size_t slab_class_size(size_t sz)
+{
+    const struct kmem_cache *cache;
+    if((cache = find_cache(sz)) != NULL)
+        return cache->kc_size;
+    return 0;
+}
+
+size_t slab_size(const void *restrict ptr)
+{
+    return ptr_to_slab(ptr)->sp_cache->kc_size;
+}
+
 void init_slab(void)
 {
     size_t i;
-    size_t npages;
+    size_t align;
 
-    for(num_slab = 0;; num_slab += 1) {
-        if(calc_blocksize(num_slab) <= (PAGE_SIZE / 4))
-            continue;
-        break;
-    }
+    caches = NULL;
 
-    npages = page_count(num_slab * sizeof(struct slab));
-    slabs = dma_alloc_hhdm(npages);
+    memset(slab_cpus, 0, sizeof(slab_cpus));
+    memset(cache_slots, 0, sizeof(cache_slots));
 
-    if(slabs == NULL) {
-        panic("slab: out of memory [pmm_alloc %zu pages]", npages);
+    profile_rate = 0;
+
+    /* These two are never behind a magazine layer:
+     * magazines themselves come from magazine_cache */
+    if(!cache_init(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL)) {
+        panic("slab: unable to bootstrap kmem_cache");
         unreachable();
     }
 
-    for(i = 0; i < num_slab; ++i) {
-        slabs[i].sl_blocksize = calc_blocksize(i);
-        slabs[i].sl_head = NULL;
+    if(!cache_init(&magazine_cache, "magazine", sizeof(struct slab_magazine), 0, NULL)) {
+        panic("slab: unable to bootstrap magazine");
+        unreachable();
+    }
+
+    slab_shrinker.sh_func = &slab_shrink;
+    pmm_register_shrinker(&slab_shrinker);
+
+    for(i = 0; i < SLAB_NUM_CLASSES; ++i) {
+        kassert(classes[i].sc_size <= SLAB_MAX_SIZE);
+        kassert(size_class(classes[i].sc_size) == i);
+
+        /* Align each class to the largest power of two dividing
+         * its size so that power of two classes stay naturally aligned */
+        align = classes[i].sc_size & (~classes[i].sc_size + 1);
 
-        if(!expand_slab(&slabs[i])) {
-            panic("slab: out of memory [slab %zu:%zu]", i, slabs[i].sl_blocksize);
+        if((size_caches[i] = kmem_cache_create(classes[i].sc_name, classes[i].sc_size, align, NULL)) == NULL) {
+            panic("slab: out of memory [%s]", classes[i].sc_name);
             unreachable();
         }
     }
@@ -1,5 +1,10 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
+#include <bitmap.h>
+#include <iecprefix.h>
+#include <kern/assert.h>
 #include <kern/panic.h>
+#include <kern/printf.h>
+#include <kern/smp.h>
 #include <limine.h>
 #include <mm/hhdm.h>
 #include <mm/kbase.h>
@@ -22,9 +27,43 @@ static volatile struct limine_paging_mode_request __used paging_mode = {
 static int pagemap_lvl3 = 0;
 static int pagemap_lvl4 = 0;
 static int pagemap_lvl5 = 0;
+static unsigned int pagemap_levels = 0;
+static unsigned int pagemap_leaf_max = 0;
+static int pagemap_global = 0;
+static int pagemap_pcid = 0;
+
+/* PCIDs are handed out in order and never reused
+ * within a generation; running out starts a new one
+ * and every CPU drops its whole TLB upon noticing that */
+static unsigned int pcid_next = 1;
+static size_t pcid_generation = 1;
+static size_t cpu_generation[MAX_CPUS] = { 0 };
+
+static const uintptr_t level_masks[6] = {
+    0, PMENTRY_LVL1_MASK, PMENTRY_LVL2_MASK,
+    PMENTRY_LVL3_MASK, PMENTRY_LVL4_MASK, PMENTRY_LVL5_MASK,
+};
+
+static const uintptr_t level_shifts[6] = {
+    0, PMENTRY_LVL1_SHIFT, PMENTRY_LVL2_SHIFT,
+    PMENTRY_LVL3_SHIFT, PMENTRY_LVL4_SHIFT, PMENTRY_LVL5_SHIFT,
+};
 
 struct pagemap sys_vm;
 
+static struct kmem_cache *pagemap_cache = NULL;
+static struct kmem_cache *area_cache = NULL;
+
+#define UPDATE_PATCH    0
+#define UPDATE_UNMAP    1
+#define UPDATE_RELEASE  2 /* Also frees the pages */
+
+/* Pagemap each CPU has loaded and the CPUs that have
+ * loaded any, the latter being who holds kernel mappings */
+static struct pagemap *active_vm[MAX_CPUS] = { 0 };
+static bitmap_t active_cpus[VMM_CPUMASK_CHUNKS] = { 0 };
+static vmm_shootdown_t shootdown = NULL;
+
 static size_t pmentry_index(uintptr_t virt, uintptr_t mask, uintptr_t shift)
 {
     /* This assumes the target architecture uses
@@ -34,19 +73,40 @@ static size_t pmentry_index(uintptr_t virt, uintptr_t mask, uintptr_t shift)
     return (size_t)((virt & (mask << shift)) >> shift);
 }
 
+static __always_inline __nodiscard inline uintptr_t level_size(unsigned int level)
+{
+    return UINT64_C(1) << level_shifts[level];
+}
+
+/* Kernel mappings are the same in every pagemap
+ * and don't need to go away on a pagemap switch */
+static __always_inline __nodiscard inline pmentry_t leaf_pmentry(uintptr_t virt, uintptr_t phys, unsigned int vprot, unsigned int level)
+{
+    pmentry_t entry;
+
+    if(level > 1)
+        entry = make_pmentry_large(phys, vprot);
+    else entry = make_pmentry(phys, vprot);
+
+    if(pagemap_global && pagemap_is_kernel(virt))
+        return pmentry_global(entry);
+    return entry;
+}
+
 static pmentry_t *get_pmentry(pmentry_t *restrict table, size_t index, int allocate)
 {
     pmentry_t *entry;
     uintptr_t address;
 
+    /* Large pages are leaves, there's no table under them */
+    if(pmentry_large(table[index]))
+        return NULL;
+
     if(!pmentry_valid(table[index])) {
         if(allocate) {
-            if((address = pmm_alloc()) != 0) {
+            if((address = pmm_alloc_zeroed()) != 0) {
                 table[index] = make_pmentry(address, VPROT_URWX);
                 entry = phys_to_hhdm(address);
-
-                memset(entry, 0, PAGE_SIZE);
-
                 return entry;
             }
         }
@@ -57,33 +117,32 @@ static pmentry_t *get_pmentry(pmentry_t *restrict table, size_t index, int alloc
     return phys_to_hhdm(pmentry_address(table[index]));
 }
 
-static pmentry_t *lookup_pmentry(pmentry_t *restrict table, uintptr_t virt, int allocate)
+/* Walks down to the entry for the address at the given
+ * level; if a large page or a missing table is in the way
+ * the walk stops there and level is updated to where that
+ * happened, the latter makes the lookup return NULL */
+static pmentry_t *lookup_pmentry(pmentry_t *restrict table, uintptr_t virt, unsigned int *restrict level, int allocate)
 {
     size_t index;
+    unsigned int i;
 
-    if(PREDICT_LVL5(pagemap_lvl5)) {
-        index = pmentry_index(virt, PMENTRY_LVL5_MASK, PMENTRY_LVL5_SHIFT);
-        table = get_pmentry(table, index, allocate);
-        if(!table) return NULL;
-    }
+    for(i = pagemap_levels; i > level[0]; --i) {
+        index = pmentry_index(virt, level_masks[i], level_shifts[i]);
 
-    if(PREDICT_LVL4(pagemap_lvl4)) {
-        index = pmentry_index(virt, PMENTRY_LVL4_MASK, PMENTRY_LVL4_SHIFT);
-        table = get_pmentry(table, index, allocate);
-        if(!table) return NULL;
-    }
+        if(pmentry_large(table[index])) {
+            level[0] = i;
+            return &table[index];
+        }
 
-    if(PREDICT_LVL3(pagemap_lvl3)) {
-        index = pmentry_index(virt, PMENTRY_LVL3_MASK, PMENTRY_LVL3_SHIFT);
         table = get_pmentry(table, index, allocate);
-        if(!table) return NULL;
-    }
 
-    index = pmentry_index(virt, PMENTRY_LVL2_MASK, PMENTRY_LVL2_SHIFT);
-    table = get_pmentry(table, index, allocate);
-    if(!table) return NULL;
+        if(!table) {
+            level[0] = i;
+            return NULL;
+        }
+    }
 
-    index = pmentry_index(virt, PMENTRY_LVL1_MASK, PMENTRY_LVL1_SHIFT);
+    index = pmentry_index(virt, level_masks[i], level_shifts[i]);
     return &table[index];
 }
 
@@ -94,7 +153,7 @@ static void pmentry_collapse(pmentry_t *restrict table, size_t begin, size_t end
 
     if(level != 0) {
         for(i = begin; i < end; ++i) {
-            if(!(next = lookup_pmentry(table, i, 0)))
+            if(!(next = get_pmentry(table, i, 0)))
                 continue;
             pmentry_collapse(next, 0, PAGEMAP_SIZE, (level - 1));
         }
@@ -108,10 +167,14 @@ struct pagemap *vmm_create(void)
     size_t i;
     struct pagemap *vm;
 
-    if((vm = slab_alloc(sizeof(struct pagemap))) != NULL) {
-        if((vm->vm_phys = pmm_alloc()) != 0) {
+    if((vm = kmem_cache_alloc(pagemap_cache)) != NULL) {
+        if((vm->vm_phys = pmm_alloc_zeroed()) != 0) {
             vm->vm_virt = phys_to_hhdm(vm->vm_phys);
-            memset(vm->vm_virt, 0, PAGE_SIZE);
+            memset(vm->vm_active, 0, sizeof(vm->vm_active));
+            memset(vm->vm_stale, 0, sizeof(vm->vm_stale));
+            vm->vm_areas = NULL;
+            vm->vm_pcid = 0;
+            vm->vm_generation = 0;
 
             for(i = PAGEMAP_KERN; i < PAGEMAP_SIZE; ++i) {
                 /* FIXME: we actually shouldn't let userspace
@@ -122,7 +185,7 @@ struct pagemap *vmm_create(void)
             return vm;
         }
 
-        slab_free(vm);
+        kmem_cache_free(pagemap_cache, vm);
     }
 
     return NULL;
@@ -135,8 +198,20 @@ struct pagemap *vmm_fork(struct pagemap *restrict stem)
     return NULL;
 }
 
+static void release_area(struct pagemap *restrict vm, const struct vm_area *restrict area, uintptr_t start, uintptr_t end);
+
 void vmm_destroy(struct pagemap *restrict vm)
 {
+    struct vm_area *area;
+
+    kassert_msg(bitmap_find_set(vm->vm_active, MAX_CPUS, 0) >= MAX_CPUS, "vmm: destroying a pagemap that is still active");
+
+    while((area = vm->vm_areas) != NULL) {
+        release_area(vm, area, area->va_start, area->va_end);
+        vm->vm_areas = area->va_next;
+        kmem_cache_free(area_cache, area);
+    }
+
     if(PREDICT_LVL5(pagemap_lvl5)) {
         pmentry_collapse(vm->vm_virt, 0, PAGEMAP_KERN, 5);
         goto cleanup;
@@ -156,21 +231,195 @@ void vmm_destroy(struct pagemap *restrict vm)
 
 cleanup:
     pmm_free(vm->vm_phys);
-    slab_free(vm);
+    kmem_cache_free(pagemap_cache, vm);
 }
 
 void vmm_switch(struct pagemap *restrict vm)
 {
-    pagemap_switch(vm->vm_phys);
+    unsigned int cpu = smp_cpu_index();
+
+    if(active_vm[cpu])
+        bitmap_clear(active_vm[cpu]->vm_active, cpu);
+    bitmap_set(vm->vm_active, cpu);
+    bitmap_set(active_cpus, cpu);
+    active_vm[cpu] = vm;
+
+    if(!pagemap_pcid) {
+        pagemap_switch(vm->vm_phys);
+        return;
+    }
+
+    /* FIXME: PCID allocation is shared between CPUs and needs a lock */
+    if((vm != &sys_vm) && (vm->vm_generation != pcid_generation)) {
+        if(pcid_next > PAGEMAP_PCID_MAX) {
+            pcid_generation += 1;
+            pcid_next = 1;
+        }
+
+        vm->vm_pcid = pcid_next++;
+        vm->vm_generation = pcid_generation;
+    }
+
+    if(cpu_generation[cpu] != pcid_generation) {
+        cpu_generation[cpu] = pcid_generation;
+        bitmap_clear(vm->vm_stale, cpu);
+        pagemap_switch_pcid(vm->vm_phys, vm->vm_pcid, 1);
+        pagemap_flush_global();
+        return;
+    }
+
+    /* Entries for the PCID might still be around from
+     * the last time the pagemap was loaded, they're only
+     * good if nothing was invalidated since then */
+    pagemap_switch_pcid(vm->vm_phys, vm->vm_pcid, bitmap_isset(vm->vm_stale, cpu));
+    bitmap_clear(vm->vm_stale, cpu);
 }
 
-int vmm_map(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, unsigned int vprot)
+void vmm_gather_begin(struct vmm_gather *restrict gather, struct pagemap *restrict vm)
+{
+    gather->vg_vm = vm;
+    gather->vg_count = 0;
+    gather->vg_nframes = 0;
+    gather->vg_kernel = (vm == &sys_vm);
+}
+
+void vmm_gather_page(struct vmm_gather *restrict gather, uintptr_t virt)
+{
+    if(pagemap_is_kernel(virt))
+        gather->vg_kernel = 1;
+    if(gather->vg_count < VMM_FLUSH_THRESHOLD)
+        gather->vg_pages[gather->vg_count] = virt;
+    gather->vg_count += 1;
+}
+
+void vmm_gather_flush_local(const struct vmm_gather *restrict gather)
+{
+    size_t i;
+
+    /* Past a certain point it's cheaper to drop
+     * the whole TLB than to go page by page */
+    if(gather->vg_count > VMM_FLUSH_THRESHOLD) {
+        if(gather->vg_kernel && pagemap_global)
+            pagemap_flush_global();
+        else pagemap_flush();
+        return;
+    }
+
+    for(i = 0; i < gather->vg_count; ++i) {
+        pagemap_invalidate(gather->vg_pages[i]);
+    }
+}
+
+void vmm_gather_frame(struct vmm_gather *restrict gather, uintptr_t phys)
+{
+    if(gather->vg_nframes >= VMM_GATHER_FRAMES)
+        vmm_gather_finish(gather);
+    gather->vg_frames[gather->vg_nframes++] = phys;
+}
+
+static void gather_flush(struct vmm_gather *restrict gather)
+{
+    size_t i;
+    unsigned int cpu;
+    bitmap_t targets[VMM_CPUMASK_CHUNKS];
+
+    /* Only the CPUs that have the pagemap loaded can
+     * have its user mappings cached; kernel mappings are
+     * shared by every pagemap and can be cached anywhere */
+    for(i = 0; i < VMM_CPUMASK_CHUNKS; ++i) {
+        if(gather->vg_kernel)
+            targets[i] = active_cpus[i];
+        else targets[i] = gather->vg_vm->vm_active[i];
+    }
+
+    cpu = smp_cpu_index();
+    bitmap_clear(targets, cpu);
+
+    if(gather->vg_kernel || bitmap_isset(gather->vg_vm->vm_active, cpu))
+        vmm_gather_flush_local(gather);
+
+    /* CPUs that ran the pagemap before can still
+     * have entries for its PCID, those are dropped
+     * the next time the pagemap is switched to */
+    if(!gather->vg_kernel) {
+        for(i = 0; i < VMM_CPUMASK_CHUNKS; ++i) {
+            gather->vg_vm->vm_stale[i] |= ~gather->vg_vm->vm_active[i];
+        }
+    }
+
+    if(shootdown && (bitmap_find_set(targets, MAX_CPUS, 0) < MAX_CPUS))
+        shootdown(gather, targets);
+}
+
+void vmm_gather_finish(struct vmm_gather *restrict gather)
 {
+    size_t i;
+
+    if(gather->vg_count != 0)
+        gather_flush(gather);
+    gather->vg_count = 0;
+
+    /* Nobody can reach the pages anymore */
+    for(i = 0; i < gather->vg_nframes; ++i)
+        pmm_free(gather->vg_frames[i]);
+
+    /* Clear as many pages as were just released, so the
+     * fault path keeps finding the zeroed pool stocked */
+    pmm_zero_worker(gather->vg_nframes);
+    gather->vg_nframes = 0;
+}
+
+void vmm_set_shootdown(vmm_shootdown_t func)
+{
+    shootdown = func;
+}
+
+static void track_mapping(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys)
+{
+    struct page *pg;
+
+    if(!pmm_page_initialized(phys))
+        return;
+    pg = phys_to_page(phys);
+
+    if(pg->pg_flags & PG_MOVABLE) {
+        if(pg->pg_owner) {
+            /* Only a single mapping can be updated on
+             * migration; a second one pins the page */
+            pg->pg_flags &= ~PG_MOVABLE;
+            pg->pg_owner = NULL;
+            return;
+        }
+
+        pg->pg_owner = vm;
+        pg->pg_index = virt;
+    }
+}
+
+static void untrack_mapping(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys)
+{
+    struct page *pg;
+
+    if(!pmm_page_initialized(phys))
+        return;
+    pg = phys_to_page(phys);
+
+    if((pg->pg_owner == vm) && (pg->pg_index == virt)) {
+        pg->pg_owner = NULL;
+        pg->pg_index = 0;
+    }
+}
+
+static int map_level(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, unsigned int vprot, unsigned int level)
+{
+    unsigned int found = level;
     pmentry_t *entry;
 
-    if((entry = lookup_pmentry(vm->vm_virt, page_align(virt), 1)) != NULL) {
-        if(!pmentry_valid(entry[0])) {
-            entry[0] = make_pmentry(page_align(phys), vprot);
+    if((entry = lookup_pmentry(vm->vm_virt, virt, &found, 1)) != NULL) {
+        if((found == level) && !pmentry_valid(entry[0])) {
+            entry[0] = leaf_pmentry(virt, phys, vprot, level);
+            if(level == 1)
+                track_mapping(vm, virt, phys);
             return 0;
         }
 
@@ -180,13 +429,89 @@ int vmm_map(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, unsigne
     return ENOMEM;
 }
 
+int vmm_map(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, unsigned int vprot)
+{
+    return map_level(vm, page_align(virt), page_align(phys), vprot, 1);
+}
+
+int vmm_map_large(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, unsigned int vprot, size_t size)
+{
+    unsigned int level;
+
+    for(level = 1; level <= pagemap_leaf_max; ++level) {
+        if(size != level_size(level))
+            continue;
+        if((virt | phys) & (size - 1))
+            return EINVAL;
+        return map_level(vm, virt, phys, vprot, level);
+    }
+
+    return EINVAL;
+}
+
+/* Large pages are only ever dealt with as a whole;
+ * an address in the middle of one is not a match */
+static pmentry_t *lookup_leaf(struct pagemap *restrict vm, uintptr_t virt, unsigned int *restrict level)
+{
+    pmentry_t *entry;
+
+    level[0] = 1;
+
+    if((entry = lookup_pmentry(vm->vm_virt, virt, level, 0)) != NULL) {
+        if(pmentry_valid(entry[0]) && !(virt & (level_size(level[0]) - 1))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
 int vmm_patch(struct pagemap *restrict vm, uintptr_t virt, unsigned int vprot)
 {
+    unsigned int level;
+    pmentry_t *entry;
+    struct vmm_gather gather;
+
+    if((entry = lookup_leaf(vm, page_align(virt), &level)) != NULL) {
+        entry[0] = leaf_pmentry(page_align(virt), pmentry_address(entry[0]), vprot, level);
+
+        vmm_gather_begin(&gather, vm);
+        vmm_gather_page(&gather, page_align(virt));
+        vmm_gather_finish(&gather);
+        return 0;
+    }
+
+    return EINVAL;
+}
+
+int vmm_unmap(struct pagemap *restrict vm, uintptr_t virt)
+{
+    unsigned int level;
     pmentry_t *entry;
+    struct vmm_gather gather;
 
-    if((entry = lookup_pmentry(vm->vm_virt, page_align(virt), 0)) != NULL) {
-        if(!pmentry_valid(entry[0])) {
-            entry[0] = make_pmentry(pmentry_address(entry[0]), vprot);
+    if((entry = lookup_leaf(vm, page_align(virt), &level)) != NULL) {
+        if(level == 1)
+            untrack_mapping(vm, page_align(virt), pmentry_address(entry[0]));
+        entry[0] = PMENTRY_NULL;
+
+        vmm_gather_begin(&gather, vm);
+        vmm_gather_page(&gather, page_align(virt));
+        vmm_gather_finish(&gather);
+        return 0;
+    }
+
+    return EINVAL;
+}
+
+int vmm_translate(struct pagemap *restrict vm, uintptr_t virt, uintptr_t *restrict phys)
+{
+    unsigned int level = 1;
+    pmentry_t *entry;
+
+    if((entry = lookup_pmentry(vm->vm_virt, virt, &level, 0)) != NULL) {
+        if(pmentry_valid(entry[0])) {
+            phys[0] = pmentry_address(entry[0]) + (virt & (level_size(level) - 1));
             return 0;
         }
     }
@@ -194,13 +519,19 @@ int vmm_patch(struct pagemap *restrict vm, uintptr_t virt, unsigned int vprot)
     return EINVAL;
 }
 
-int vmm_unmap(struct pagemap *restrict vm, uintptr_t virt)
+int vmm_remap(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys)
 {
+    unsigned int level;
     pmentry_t *entry;
+    struct vmm_gather gather;
+
+    if((entry = lookup_leaf(vm, page_align(virt), &level)) != NULL) {
+        if(level == 1) {
+            entry[0] = pmentry_remap(entry[0], page_align(phys));
 
-    if((entry = lookup_pmentry(vm->vm_virt, page_align(virt), 0)) != NULL) {
-        if(!pmentry_valid(entry[0])) {
-            entry[0] = PMENTRY_NULL;
+            vmm_gather_begin(&gather, vm);
+            vmm_gather_page(&gather, page_align(virt));
+            vmm_gather_finish(&gather);
             return 0;
         }
     }
@@ -208,56 +539,357 @@ int vmm_unmap(struct pagemap *restrict vm, uintptr_t virt)
     return EINVAL;
 }
 
-static int vmm_map_section(const void *restrict start, const void *restrict end, unsigned int vprot)
+static unsigned int fit_level(uintptr_t virt, uintptr_t virt_end, uintptr_t phys, unsigned int level)
 {
-    int r;
-    uintptr_t phys;
-    uintptr_t virt;
-    uintptr_t virt_end;
+    while(level > 1) {
+        if(!((virt | phys) & (level_size(level) - 1)) && (level_size(level) <= (virt_end - virt)))
+            break;
+        level -= 1;
+    }
 
-    virt = page_align((uintptr_t)start);
-    virt_end = page_align_up((uintptr_t)end);
-    phys = virt - kbase_virt + kbase_phys;
+    return level;
+}
+
+static int update_range(struct pagemap *restrict vm, uintptr_t virt, uintptr_t virt_end, unsigned int mode, unsigned int vprot);
+
+/* Each table on the way is looked up once and then
+ * filled in for as long as the range stays within it; if
+ * lenient, pages that are already mapped are skipped over,
+ * otherwise whatever got mapped is undone on failure */
+static int map_range(struct pagemap *restrict vm, uintptr_t virt, uintptr_t virt_end, uintptr_t phys, unsigned int vprot, int lenient)
+{
+    int r;
+    uintptr_t size;
+    uintptr_t start = virt;
+    unsigned int cap = pagemap_leaf_max;
+    unsigned int level, found;
+    pmentry_t *entry;
 
     while(virt < virt_end) {
-        if((r = vmm_map(&sys_vm, virt, phys, vprot)) == 0) {
-            phys += PAGE_SIZE;
-            virt += PAGE_SIZE;
+        found = level = fit_level(virt, virt_end, phys, cap);
+        size = level_size(level);
+
+        if((entry = lookup_pmentry(vm->vm_virt, virt, &found, 1)) == NULL) {
+            r = ENOMEM;
+            goto failure;
+        }
+
+        if(found != level) {
+            /* A large page covers the address */
+            if(!lenient) {
+                r = EINVAL;
+                goto failure;
+            }
+
+            size = level_size(found) - (virt & (level_size(found) - 1));
+            phys += size;
+            virt += size;
             continue;
         }
 
-        return r;
+        if(pmentry_valid(entry[0])) {
+            /* A table of smaller pages is in the way */
+            if((level > 1) && !pmentry_large(entry[0])) {
+                cap = level - 1;
+                continue;
+            }
+
+            if(!lenient) {
+                r = EINVAL;
+                goto failure;
+            }
+
+            phys += size;
+            virt += size;
+            continue;
+        }
+
+        /* The next address that could take a larger
+         * page is also where the next table begins */
+        do {
+            entry[0] = leaf_pmentry(virt, phys, vprot, level);
+            if(level == 1)
+                track_mapping(vm, virt, phys);
+
+            entry += 1;
+            phys += size;
+            virt += size;
+        } while((size <= (virt_end - virt)) && pmentry_index(virt, level_masks[level], level_shifts[level]) && !pmentry_valid(entry[0]));
+
+        cap = pagemap_leaf_max;
     }
 
     return 0;
+
+failure:
+    if(!lenient)
+        update_range(vm, start, virt, UPDATE_UNMAP, 0);
+    return r;
 }
 
-static int vmm_map_memmap(const struct limine_memmap_entry *restrict entry)
+/* Either unmaps or changes the protection of every
+ * page in the range, collecting what has to be invalidated */
+static int update_range(struct pagemap *restrict vm, uintptr_t virt, uintptr_t virt_end, unsigned int mode, unsigned int vprot)
 {
-    int r;
-    uintptr_t phys;
-    uintptr_t virt;
-    uintptr_t virt_end;
+    int r = 0;
+    uintptr_t size;
+    unsigned int level;
+    pmentry_t *entry;
+    struct vmm_gather gather;
 
-    phys = page_align(entry->base);
-    virt = page_align(entry->base) + hhdm_offset;
-    virt_end = page_align_up(virt + entry->length);
+    vmm_gather_begin(&gather, vm);
 
     while(virt < virt_end) {
-        r = vmm_map(&sys_vm, virt, phys, VPROT_RWX);
+        level = 1;
 
-        if(r == 0 || r == EINVAL) {
-            phys += PAGE_SIZE;
-            virt += PAGE_SIZE;
+        if((entry = lookup_pmentry(vm->vm_virt, virt, &level, 0)) == NULL) {
+            /* Nothing is mapped up until the next table */
+            virt += level_size(level) - (virt & (level_size(level) - 1));
             continue;
         }
 
+        size = level_size(level);
+
+        if(level > 1) {
+            /* Large pages are never split */
+            if((virt & (size - 1)) || (size > (virt_end - virt))) {
+                r = EINVAL;
+                break;
+            }
+
+            if(mode != UPDATE_PATCH)
+                entry[0] = PMENTRY_NULL;
+            else entry[0] = leaf_pmentry(virt, pmentry_address(entry[0]), vprot, level);
+
+            vmm_gather_page(&gather, virt);
+            virt += size;
+            continue;
+        }
+
+        do {
+            if(pmentry_valid(entry[0])) {
+                if(mode != UPDATE_PATCH) {
+                    untrack_mapping(vm, virt, pmentry_address(entry[0]));
+                    if(mode == UPDATE_RELEASE)
+                        vmm_gather_frame(&gather, pmentry_address(entry[0]));
+                    entry[0] = PMENTRY_NULL;
+                }
+                else {
+                    entry[0] = leaf_pmentry(virt, pmentry_address(entry[0]), vprot, 1);
+                }
+
+                vmm_gather_page(&gather, virt);
+            }
+
+            entry += 1;
+            virt += size;
+        } while((virt < virt_end) && pmentry_index(virt, level_masks[1], level_shifts[1]));
+    }
+
+    vmm_gather_finish(&gather);
+
+    return r;
+}
+
+int vmm_map_range(struct pagemap *restrict vm, uintptr_t virt, uintptr_t phys, size_t size, unsigned int vprot)
+{
+    return map_range(vm, page_align(virt), page_align_up(virt + size), page_align(phys), vprot, 0);
+}
+
+int vmm_unmap_range(struct pagemap *restrict vm, uintptr_t virt, size_t size)
+{
+    return update_range(vm, page_align(virt), page_align_up(virt + size), UPDATE_UNMAP, 0);
+}
+
+int vmm_patch_range(struct pagemap *restrict vm, uintptr_t virt, size_t size, unsigned int vprot)
+{
+    return update_range(vm, page_align(virt), page_align_up(virt + size), UPDATE_PATCH, vprot);
+}
+
+int vmm_unmap_range_free(struct pagemap *restrict vm, uintptr_t virt, size_t size)
+{
+    return update_range(vm, page_align(virt), page_align_up(virt + size), UPDATE_RELEASE, 0);
+}
+
+static struct vm_area *find_area(const struct pagemap *restrict vm, uintptr_t virt)
+{
+    struct vm_area *area;
+
+    for(area = vm->vm_areas; area && (area->va_start <= virt); area = area->va_next) {
+        if(virt < area->va_end) {
+            return area;
+        }
+    }
+
+    return NULL;
+}
+
+static void release_area(struct pagemap *restrict vm, const struct vm_area *restrict area, uintptr_t start, uintptr_t end)
+{
+    /* Nothing but what the fault handler put
+     * there can be freed along with the mapping */
+    if(area->va_flags & VMA_ANON)
+        update_range(vm, start, end, UPDATE_RELEASE, 0);
+    else update_range(vm, start, end, UPDATE_UNMAP, 0);
+}
+
+int vmm_reserve(struct pagemap *restrict vm, uintptr_t virt, size_t size, unsigned int vprot, unsigned int flags)
+{
+    uintptr_t end = virt + size;
+    struct vm_area *area;
+    struct vm_area **link;
+
+    if((virt != page_align(virt)) || (size != page_align(size)) || (size == 0) || (end < virt))
+        return EINVAL;
+
+    /* FIXME: the area list needs a lock */
+    for(link = &vm->vm_areas; link[0] && (link[0]->va_end <= virt); link = &link[0]->va_next);
+
+    if(link[0] && (link[0]->va_start < end))
+        return EEXIST;
+
+    if((area = kmem_cache_alloc(area_cache)) != NULL) {
+        area->va_start = virt;
+        area->va_end = end;
+        area->va_prot = vprot;
+        area->va_flags = flags;
+        area->va_next = link[0];
+        link[0] = area;
+        return 0;
+    }
+
+    return ENOMEM;
+}
+
+int vmm_release(struct pagemap *restrict vm, uintptr_t virt, size_t size)
+{
+    uintptr_t end = page_align_up(virt + size);
+    struct vm_area *area;
+    struct vm_area *tail;
+    struct vm_area **link;
+
+    virt = page_align(virt);
+
+    for(link = &vm->vm_areas; (area = link[0]) != NULL && (area->va_start < end);) {
+        if(area->va_end <= virt) {
+            link = &area->va_next;
+            continue;
+        }
+
+        if((area->va_start < virt) && (area->va_end > end)) {
+            /* Punching a hole splits the area in two */
+            if((tail = kmem_cache_alloc(area_cache)) == NULL)
+                return ENOMEM;
+            tail->va_start = end;
+            tail->va_end = area->va_end;
+            tail->va_prot = area->va_prot;
+            tail->va_flags = area->va_flags;
+            tail->va_next = area->va_next;
+
+            release_area(vm, area, virt, end);
+            area->va_end = virt;
+            area->va_next = tail;
+            return 0;
+        }
+
+        if(area->va_start < virt) {
+            release_area(vm, area, virt, area->va_end);
+            area->va_end = virt;
+            link = &area->va_next;
+            continue;
+        }
+
+        if(area->va_end > end) {
+            release_area(vm, area, area->va_start, end);
+            area->va_start = end;
+            return 0;
+        }
+
+        release_area(vm, area, area->va_start, area->va_end);
+        link[0] = area->va_next;
+        kmem_cache_free(area_cache, area);
+    }
+
+    return 0;
+}
+
+int vmm_fault(uintptr_t virt, unsigned int flags)
+{
+    int r;
+    uintptr_t phys;
+    unsigned int access;
+    struct pagemap *vm;
+    struct vm_area *area;
+
+    vm = active_vm[smp_cpu_index()];
+    if(pagemap_is_kernel(virt) || (vm == NULL))
+        vm = &sys_vm;
+
+    if((area = find_area(vm, virt)) == NULL)
+        return EFAULT;
+
+    access = VPROT_READ;
+    if(flags & VMM_FAULT_WRITE)
+        access |= VPROT_WRITE;
+    if(flags & VMM_FAULT_EXEC)
+        access |= VPROT_EXEC;
+    if(flags & VMM_FAULT_USER)
+        access |= VPROT_USER;
+
+    if(access & ~area->va_prot)
+        return EACCES;
+
+    /* The page is there and allows the access, so this
+     * is a translation that was cached while it was not */
+    if(vmm_translate(vm, virt, &phys) == 0) {
+        if(flags & VMM_FAULT_PRESENT)
+            return EACCES;
+        pagemap_invalidate(page_align(virt));
+        return 0;
+    }
+
+    if(!(area->va_flags & VMA_ANON))
+        return EFAULT;
+
+    if((phys = pmm_alloc_zeroed()) == 0)
+        return ENOMEM;
+
+    if((r = map_level(vm, page_align(virt), phys, area->va_prot, 1)) != 0) {
+        pmm_free(phys);
         return r;
     }
 
     return 0;
 }
 
+static int vmm_map_section(const void *restrict start, const void *restrict end, unsigned int vprot)
+{
+    uintptr_t phys;
+    uintptr_t virt;
+    uintptr_t virt_end;
+
+    virt = page_align((uintptr_t)start);
+    virt_end = page_align_up((uintptr_t)end);
+    phys = virt - kbase_virt + kbase_phys;
+
+    return map_range(&sys_vm, virt, virt_end, phys, vprot, 0);
+}
+
+static int vmm_map_memmap(const struct limine_memmap_entry *restrict entry)
+{
+    uintptr_t phys;
+    uintptr_t virt;
+    uintptr_t virt_end;
+
+    phys = page_align(entry->base);
+    virt = page_align(entry->base) + hhdm_offset;
+    virt_end = page_align_up(virt + entry->length);
+
+    /* Entries that do not start or end on a page
+     * boundary share a page with their neighbours */
+    return map_range(&sys_vm, virt, virt_end, phys, VPROT_RWX, 1);
+}
+
 void init_vmm(void)
 {
     int r;
@@ -272,6 +904,30 @@ void init_vmm(void)
     pagemap_lvl4 = 0;
     pagemap_lvl5 = 0;
 
+    memset(active_vm, 0, sizeof(active_vm));
+    memset(active_cpus, 0, sizeof(active_cpus));
+    memset(sys_vm.vm_active, 0, sizeof(sys_vm.vm_active));
+    memset(sys_vm.vm_stale, 0, sizeof(sys_vm.vm_stale));
+    memset(cpu_generation, 0, sizeof(cpu_generation));
+    shootdown = NULL;
+
+    pcid_next = 1;
+    pcid_generation = 1;
+    sys_vm.vm_pcid = 0;
+    sys_vm.vm_generation = 0;
+
+    /* Both have to be on before anything gets mapped; the
+     * bootloader's pagemap is running with PCID zero as well.
+     * PCIDs are left off without global pages: invalidating
+     * a kernel address would only reach the PCID that is
+     * loaded and every other one would keep a stale entry */
+    pagemap_global = pagemap_has_global();
+    if(pagemap_global)
+        pagemap_enable_global();
+    pagemap_pcid = pagemap_global && pagemap_has_pcid();
+    if(pagemap_pcid)
+        pagemap_enable_pcid();
+
     /* Here's the interaction I had with one of Limine
      * developers in the OSDev Discord server regarding
      * going with such method of VMM testing the waters:
@@ -292,13 +948,38 @@ void init_vmm(void)
     if(paging_mode.response->mode >= PAGING_MODE_LVL5)
         pagemap_lvl5 = 1;
 
-    if((sys_vm.vm_phys = pmm_alloc()) == 0) {
+    pagemap_levels = 2;
+    if(PREDICT_LVL3(pagemap_lvl3))
+        pagemap_levels = 3;
+    if(PREDICT_LVL4(pagemap_lvl4))
+        pagemap_levels = 4;
+    if(PREDICT_LVL5(pagemap_lvl5))
+        pagemap_levels = 5;
+
+    pagemap_leaf_max = 1;
+    if(PMENTRY_LEAF_LVL2)
+        pagemap_leaf_max = 2;
+    if((pagemap_leaf_max == 2) && PMENTRY_LEAF_LVL3)
+        pagemap_leaf_max = 3;
+
+    if((sys_vm.vm_phys = pmm_alloc_zeroed()) == 0) {
         panic("vmm: out of memory");
         unreachable();
     }
 
     sys_vm.vm_virt = phys_to_hhdm(sys_vm.vm_phys);
-    memset(sys_vm.vm_virt, 0, PAGE_SIZE);
+
+    if((pagemap_cache = kmem_cache_create("pagemap", sizeof(struct pagemap), 0, NULL)) == NULL) {
+        panic("vmm: out of memory");
+        unreachable();
+    }
+
+    if((area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), 0, NULL)) == NULL) {
+        panic("vmm: out of memory");
+        unreachable();
+    }
+
+    sys_vm.vm_areas = NULL;
 
     /* Allocate top-level sys_vm entries */
     for(i = PAGEMAP_KERN; i < PAGEMAP_SIZE; ++i) {
@@ -330,5 +1011,8 @@ void init_vmm(void)
         }
     }
 
+    kprintf(KP_INFORM, "vmm: %u-level paging, pages up to %zu KiB%s%s", pagemap_levels, (size_t)(level_size(pagemap_leaf_max) >> KIBI),
+        pagemap_global ? ", global pages" : "", pagemap_pcid ? ", PCID" : "");
+
     vmm_switch(&sys_vm);
 }
@@ -9,6 +9,19 @@ qargs="${qargs} -debugcon stdio"
 qargs="${qargs} -machine type=q35"
 qargs="${qargs} -vga std"
 qargs="${qargs} -m 512M"
+
+if test "x${QEMU_NUMA}" = "x1"
+then
+    # Split the machine into two NUMA nodes with
+    # a CPU and half of the memory each; this is how
+    # SRAT/SLIT parsing and node fallback get exercised
+    qargs="${qargs} -smp 2"
+    qargs="${qargs} -object memory-backend-ram,id=mem0,size=256M"
+    qargs="${qargs} -object memory-backend-ram,id=mem1,size=256M"
+    qargs="${qargs} -numa node,nodeid=0,cpus=0,memdev=mem0"
+    qargs="${qargs} -numa node,nodeid=1,cpus=1,memdev=mem1"
+    qargs="${qargs} -numa dist,src=0,dst=1,val=21"
+fi
 #qargs="${qargs} -d cpu_reset -d int -no-reboot -no-shutdown"
 
 if test -f "/proc/sys/fs/binfmt_misc/WSLInterop"